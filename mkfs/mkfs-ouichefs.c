@@ -32,6 +32,8 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count (subdir count for directories) */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t start_block; /* Block with the start of each slice, or 0 */
+	uint32_t i_slices; /* Used entries of the index block */
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
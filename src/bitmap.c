@@ -0,0 +1,1186 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/bitmap.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "ioctl.h"
+
+/*
+ * Block and inode allocators.
+ *
+ * Inode bits are claimed with test_and_clear_bit() and released with
+ * set_bit(), without a lock. Block allocations go through the free extents
+ * below, under the spinlock of a group held for O(log n). The free counts are
+ * percpu counters, written to the superblock on sync.
+ *
+ * The bitmaps live in the buffers of their blocks, which stay pinned while
+ * the volume is mounted. Each change marks the block in ifree_dirty or
+ * bfree_dirty, and only these blocks are written back on sync.
+ *
+ * Nothing is read at mount: a bitmap block is read the first time it is
+ * needed, and a background work reads the others right after the mount. The
+ * free counts come from the superblock.
+ *
+ * Each CPU has its own search cursors. They start in different slices of the
+ * bitmaps so that CPUs allocating without a goal do not compete for the same
+ * bits.
+ *
+ * Blocks are split in groups of OUICHEFS_BGROUP_BITS blocks, one bitmap block
+ * each. The number of free blocks of each group is kept in bgroup_free,
+ * and bgroup_map has a bit set for each group that is not full, or not read
+ * yet.
+ */
+
+static inline uint32_t bgroup(uint32_t bno)
+{
+	return bno / OUICHEFS_BGROUP_BITS;
+}
+
+/* Bits of a bitmap block, kept in its pinned buffer */
+static inline unsigned long *bitmap_bits(struct buffer_head **bhs, uint32_t i)
+{
+	return (unsigned long *)bhs[i]->b_data;
+}
+
+static inline uint32_t ifree_first_block(struct ouichefs_sb_info *sbi)
+{
+	return sbi->nr_istore_blocks + 1;
+}
+
+static inline uint32_t bfree_first_block(struct ouichefs_sb_info *sbi)
+{
+	return sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1;
+}
+
+/*
+ * Return the buffer of the i-th block of the free inodes bitmap, reading and
+ * pinning it the first time. Return NULL if it could not be read.
+ */
+static struct buffer_head *ifree_load(struct ouichefs_sb_info *sbi,
+				      uint32_t i)
+{
+	struct buffer_head *bh = smp_load_acquire(&sbi->ifree_bh[i]);
+
+	if (bh)
+		return bh;
+
+	mutex_lock(&sbi->bitmap_mutex);
+	bh = sbi->ifree_bh[i];
+	if (!bh) {
+		bh = sb_bread(sbi->sb, ifree_first_block(sbi) + i);
+		if (bh)
+			smp_store_release(&sbi->ifree_bh[i], bh);
+	}
+	mutex_unlock(&sbi->bitmap_mutex);
+
+	return bh;
+}
+
+/*
+ * Count nr blocks from bno as used in the group summary.
+ */
+static void bgroups_sub(struct ouichefs_sb_info *sbi, uint32_t bno,
+			uint32_t nr)
+{
+	uint32_t g, in_group;
+
+	while (nr) {
+		g = bgroup(bno);
+		in_group = min(nr, (g + 1) * OUICHEFS_BGROUP_BITS - bno);
+
+		if (!atomic_sub_return(in_group, &sbi->bgroup_free[g])) {
+			clear_bit(g, sbi->bgroup_map);
+			/* A block may have been freed in the meantime */
+			if (atomic_read(&sbi->bgroup_free[g]))
+				set_bit(g, sbi->bgroup_map);
+		}
+
+		bno += in_group;
+		nr -= in_group;
+	}
+}
+
+/*
+ * Claim the first free bit of bits between from and to.
+ * Return to if there is none.
+ */
+static unsigned long claim_first_free_bit(unsigned long *bits,
+					  unsigned long from, unsigned long to)
+{
+	unsigned long bit;
+
+	for (bit = find_next_bit(bits, to, from); bit < to;
+	     bit = find_next_bit(bits, to, bit + 1))
+		if (test_and_clear_bit(bit, bits))
+			return bit;
+
+	return to;
+}
+
+/*
+ * Return an unused inode number and mark it used. The search starts where the
+ * previous one of this CPU stopped, goes through the following bitmap blocks
+ * and wraps around.
+ * Return 0 if no free inode was found (we assume that the first inode is never
+ * free, thus allowing us to use 0 as an error value).
+ */
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+{
+	uint32_t goal = this_cpu_read(*sbi->inode_cursor);
+	uint32_t nr = DIV_ROUND_UP(sbi->nr_inodes, OUICHEFS_BGROUP_BITS);
+	uint32_t first, i, k, from, to, nbits;
+	unsigned long bit;
+
+	if (goal >= sbi->nr_inodes)
+		goal = 0;
+	first = goal / OUICHEFS_BGROUP_BITS;
+
+	/* The first block is looked at twice, after goal then before it */
+	for (k = 0; k <= nr; k++) {
+		i = (first + k) % nr;
+		nbits = min_t(uint32_t, OUICHEFS_BGROUP_BITS,
+			      sbi->nr_inodes - i * OUICHEFS_BGROUP_BITS);
+		from = k == 0 ? goal % OUICHEFS_BGROUP_BITS : 0;
+		to = k == nr ? goal % OUICHEFS_BGROUP_BITS : nbits;
+
+		if (!ifree_load(sbi, i))
+			continue;
+		bit = claim_first_free_bit(bitmap_bits(sbi->ifree_bh, i), from,
+					   to);
+		if (bit < to) {
+			set_bit(i, sbi->ifree_dirty);
+			goal = i * OUICHEFS_BGROUP_BITS + bit;
+			percpu_counter_dec(&sbi->free_inodes);
+			this_cpu_write(*sbi->inode_cursor, goal + 1);
+			pr_debug("%s:%d: allocated inode %u\n", __func__,
+				 __LINE__, goal);
+			return goal;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Return true if an inode is marked used in the free inodes bitmap.
+ */
+bool inode_in_use(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	uint32_t i = ino / OUICHEFS_BGROUP_BITS;
+
+	if (ino >= sbi->nr_inodes || !ifree_load(sbi, i))
+		return false;
+	return !test_bit(ino % OUICHEFS_BGROUP_BITS,
+			 bitmap_bits(sbi->ifree_bh, i));
+}
+
+/*
+ * Mark an inode as unused.
+ */
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	/* ino is out of the bitmap */
+	if (ino >= sbi->nr_inodes)
+		return;
+
+	if (!ifree_load(sbi, ino / OUICHEFS_BGROUP_BITS)) {
+		pr_err("could not read the bitmap of inode %u\n", ino);
+		return;
+	}
+
+	set_bit(ino % OUICHEFS_BGROUP_BITS,
+		bitmap_bits(sbi->ifree_bh, ino / OUICHEFS_BGROUP_BITS));
+	set_bit(ino / OUICHEFS_BGROUP_BITS, sbi->ifree_dirty);
+	percpu_counter_inc(&sbi->free_inodes);
+	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
+}
+
+/*
+ * Free extents.
+ *
+ * The free blocks of each group are also kept as extents in two rbtrees, one
+ * sorted by start and one by length, so that a run of a given length is found
+ * in O(log n). Extents never cross a group boundary. The trees and the bits of
+ * the bitmap block of a group are protected by the lock of the group, so that
+ * CPUs allocating in different groups do not wait for each other. The length
+ * of the largest extent of each group is read without the lock to pick the
+ * group to allocate from.
+ */
+
+struct ouichefs_free_extent {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	uint32_t start;
+	uint32_t len;
+};
+
+static struct kmem_cache *ouichefs_extent_cache;
+
+int ouichefs_init_extent_cache(void)
+{
+	ouichefs_extent_cache = kmem_cache_create(
+		"ouichefs_extent", sizeof(struct ouichefs_free_extent), 0, 0,
+		NULL);
+	if (!ouichefs_extent_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+void ouichefs_destroy_extent_cache(void)
+{
+	kmem_cache_destroy(ouichefs_extent_cache);
+}
+
+#define by_start_entry(node) \
+	rb_entry(node, struct ouichefs_free_extent, by_start)
+#define by_len_entry(node) rb_entry(node, struct ouichefs_free_extent, by_len)
+
+static void ext_insert_start(struct ouichefs_bgroup *bg,
+			     struct ouichefs_free_extent *e)
+{
+	struct rb_node **p = &bg->by_start.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (e->start < by_start_entry(parent)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&e->by_start, parent, p);
+	rb_insert_color(&e->by_start, &bg->by_start);
+}
+
+/* Extents of the same length are sorted by start */
+static void ext_insert_len(struct ouichefs_bgroup *bg,
+			   struct ouichefs_free_extent *e)
+{
+	struct rb_node **p = &bg->by_len.rb_node, *parent = NULL;
+	struct ouichefs_free_extent *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = by_len_entry(parent);
+		if (e->len < cur->len ||
+		    (e->len == cur->len && e->start < cur->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&e->by_len, parent, p);
+	rb_insert_color(&e->by_len, &bg->by_len);
+}
+
+static void ext_insert(struct ouichefs_bgroup *bg,
+		       struct ouichefs_free_extent *e)
+{
+	ext_insert_start(bg, e);
+	ext_insert_len(bg, e);
+	bg->nr_extents++;
+}
+
+static void ext_erase(struct ouichefs_bgroup *bg,
+		      struct ouichefs_free_extent *e)
+{
+	rb_erase(&e->by_start, &bg->by_start);
+	rb_erase(&e->by_len, &bg->by_len);
+	bg->nr_extents--;
+}
+
+/*
+ * Change the bounds of an extent, keeping its place in the start tree. The
+ * caller makes sure that it does not overlap its neighbours.
+ */
+static void ext_resize(struct ouichefs_bgroup *bg,
+		       struct ouichefs_free_extent *e, uint32_t start,
+		       uint32_t len)
+{
+	rb_erase(&e->by_len, &bg->by_len);
+	e->start = start;
+	e->len = len;
+	ext_insert_len(bg, e);
+}
+
+/* Publish the length of the largest extent once the group changed */
+static void ext_update_largest(struct ouichefs_bgroup *bg)
+{
+	struct rb_node *n = rb_last(&bg->by_len);
+
+	WRITE_ONCE(bg->largest, n ? by_len_entry(n)->len : 0);
+}
+
+/*
+ * Return the last extent starting at or before bno, NULL if there is none.
+ */
+static struct ouichefs_free_extent *ext_lookup(struct ouichefs_bgroup *bg,
+					       uint32_t bno)
+{
+	struct rb_node *n = bg->by_start.rb_node;
+	struct ouichefs_free_extent *e, *found = NULL;
+
+	while (n) {
+		e = by_start_entry(n);
+		if (e->start <= bno) {
+			found = e;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Return the smallest extent of at least nr blocks, or the largest extent if
+ * there is none. Return NULL if there is no free extent.
+ */
+static struct ouichefs_free_extent *ext_best_fit(struct ouichefs_bgroup *bg,
+						 uint32_t nr)
+{
+	struct rb_node *n = bg->by_len.rb_node;
+	struct ouichefs_free_extent *e, *found = NULL;
+
+	while (n) {
+		e = by_len_entry(n);
+		if (e->len >= nr) {
+			found = e;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (found)
+		return found;
+
+	n = rb_last(&bg->by_len);
+	return n ? by_len_entry(n) : NULL;
+}
+
+/*
+ * Take nr blocks from bno out of extent e. spare is used if the extent has to
+ * be split, and is set to NULL if so.
+ */
+static void ext_take(struct ouichefs_bgroup *bg,
+		     struct ouichefs_free_extent *e, uint32_t bno, uint32_t nr,
+		     struct ouichefs_free_extent **spare)
+{
+	uint32_t end = e->start + e->len;
+
+	if (bno == e->start && nr == e->len) {
+		ext_erase(bg, e);
+		kmem_cache_free(ouichefs_extent_cache, e);
+	} else if (bno == e->start) {
+		ext_resize(bg, e, bno + nr, e->len - nr);
+	} else if (bno + nr == end) {
+		ext_resize(bg, e, e->start, e->len - nr);
+	} else {
+		(*spare)->start = bno + nr;
+		(*spare)->len = end - (bno + nr);
+		ext_insert(bg, *spare);
+		*spare = NULL;
+		ext_resize(bg, e, e->start, bno - e->start);
+	}
+	ext_update_largest(bg);
+}
+
+/*
+ * Blocks freed while the bitmap block of their group could not be read. They
+ * stay used until the group is loaded, and are freed then.
+ */
+struct ouichefs_deferred_free {
+	struct list_head list;
+	uint32_t start;
+	uint32_t len;
+};
+
+/*
+ * Remember that nr blocks from bno are to be freed once their group is
+ * loaded. Return false if the group was loaded in the meantime, in which
+ * case the caller frees them.
+ */
+static bool bgroup_defer_free(struct ouichefs_sb_info *sbi, uint32_t bno,
+			      uint32_t nr)
+{
+	struct ouichefs_deferred_free *df;
+
+	df = kmalloc(sizeof(*df), GFP_NOFS | __GFP_NOFAIL);
+	df->start = bno;
+	df->len = nr;
+
+	mutex_lock(&sbi->bitmap_mutex);
+	if (sbi->bfree_bh[bgroup(bno)]) {
+		mutex_unlock(&sbi->bitmap_mutex);
+		kfree(df);
+		return false;
+	}
+	list_add_tail(&df->list, &sbi->deferred_frees);
+	mutex_unlock(&sbi->bitmap_mutex);
+
+	pr_warn("could not read the bitmap of block %u, freeing it later\n",
+		bno);
+	return true;
+}
+
+/*
+ * Read and pin the bitmap block of group g the first time it is needed, and
+ * add its free extents to the trees. The blocks whose free was deferred are
+ * freed once it is loaded.
+ * Return 0 if the group is loaded, an error otherwise.
+ */
+static int bgroup_load(struct ouichefs_sb_info *sbi, uint32_t g)
+{
+	struct ouichefs_free_extent **exts = NULL;
+	struct ouichefs_deferred_free *df, *tmp;
+	struct buffer_head *bh;
+	unsigned long *bits, bit, end;
+	uint32_t nbits, nr_exts = 0, i;
+	LIST_HEAD(deferred);
+	int ret = 0;
+
+	if (smp_load_acquire(&sbi->bfree_bh[g]))
+		return 0;
+
+	mutex_lock(&sbi->bitmap_mutex);
+	if (sbi->bfree_bh[g])
+		goto unlock;
+
+	bh = sb_bread(sbi->sb, bfree_first_block(sbi) + g);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	bits = (unsigned long *)bh->b_data;
+	nbits = min_t(uint32_t, OUICHEFS_BGROUP_BITS,
+		      sbi->nr_blocks - g * OUICHEFS_BGROUP_BITS);
+
+	/* Allocate the extents first, they are inserted under the spinlock */
+	for (bit = find_first_bit(bits, nbits); bit < nbits;
+	     bit = find_next_bit(bits, nbits, end)) {
+		end = find_next_zero_bit(bits, nbits, bit);
+		nr_exts++;
+	}
+	exts = kvmalloc_array(nr_exts, sizeof(*exts), GFP_KERNEL);
+	if (!exts && nr_exts) {
+		ret = -ENOMEM;
+		goto release_bh;
+	}
+	i = 0;
+	for (bit = find_first_bit(bits, nbits); bit < nbits;
+	     bit = find_next_bit(bits, nbits, end)) {
+		end = find_next_zero_bit(bits, nbits, bit);
+		exts[i] = kmem_cache_alloc(ouichefs_extent_cache, GFP_KERNEL);
+		if (!exts[i]) {
+			ret = -ENOMEM;
+			goto free_exts;
+		}
+		exts[i]->start = g * OUICHEFS_BGROUP_BITS + bit;
+		exts[i]->len = end - bit;
+		i++;
+	}
+
+	spin_lock(&sbi->bgroups[g].lock);
+	for (i = 0; i < nr_exts; i++)
+		ext_insert(&sbi->bgroups[g], exts[i]);
+	ext_update_largest(&sbi->bgroups[g]);
+	atomic_set(&sbi->bgroup_free[g], bitmap_weight(bits, nbits));
+	if (!atomic_read(&sbi->bgroup_free[g]))
+		clear_bit(g, sbi->bgroup_map);
+	smp_store_release(&sbi->bfree_bh[g], bh);
+	spin_unlock(&sbi->bgroups[g].lock);
+	WRITE_ONCE(sbi->nr_bgroups_loaded, sbi->nr_bgroups_loaded + 1);
+
+	kvfree(exts);
+	list_for_each_entry_safe(df, tmp, &sbi->deferred_frees, list)
+		if (bgroup(df->start) == g)
+			list_move_tail(&df->list, &deferred);
+	goto unlock;
+
+free_exts:
+	while (i--)
+		kmem_cache_free(ouichefs_extent_cache, exts[i]);
+	kvfree(exts);
+release_bh:
+	brelse(bh);
+unlock:
+	mutex_unlock(&sbi->bitmap_mutex);
+
+	list_for_each_entry_safe(df, tmp, &deferred, list) {
+		put_blocks(sbi, df->start, df->len);
+		kfree(df);
+	}
+
+	return ret;
+}
+
+/*
+ * Load the first group not read yet from group g, wrapping around.
+ * Return 0 if a group was loaded.
+ */
+static int bgroup_load_next(struct ouichefs_sb_info *sbi, uint32_t g)
+{
+	uint32_t k, i;
+
+	for (k = 0; k < sbi->nr_bgroups; k++) {
+		i = (g + k) % sbi->nr_bgroups;
+		if (!READ_ONCE(sbi->bfree_bh[i]))
+			return bgroup_load(sbi, i);
+	}
+
+	return -ENOSPC;
+}
+
+/* Flags of alloc_blocks() */
+#define ALLOC_NOWAIT 0x1 /* Never sleep */
+#define ALLOC_RSV 0x2 /* For a reservation window, keep the bitmap bits */
+
+/*
+ * Return the loaded group whose largest free extent fits nr blocks best, or
+ * the one with the largest extent if none is large enough. Return NULL if no
+ * loaded group has a free block. Full groups are skipped through bgroup_map.
+ * The lengths are read without the locks, the caller checks the extent it
+ * gets.
+ */
+static struct ouichefs_bgroup *bgroup_best_fit(struct ouichefs_sb_info *sbi,
+					       uint32_t nr)
+{
+	struct ouichefs_bgroup *found = NULL;
+	uint32_t len, found_len = 0;
+	unsigned long g;
+
+	for_each_set_bit(g, sbi->bgroup_map, sbi->nr_bgroups) {
+		if (!smp_load_acquire(&sbi->bfree_bh[g]))
+			continue;
+		len = READ_ONCE(sbi->bgroups[g].largest);
+		if (!len)
+			continue;
+		if (!found || (found_len < nr && len > found_len) ||
+		    (len >= nr && len < found_len)) {
+			found = &sbi->bgroups[g];
+			found_len = len;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Mark up to nr contiguous unused blocks as used, and store the first one in
+ * bno.
+ * Blocks are taken from goal if it is free, so that a file keeps growing in
+ * place. The goal is the one of this CPU if none is given. Otherwise, the
+ * smallest free extent of at least nr blocks is used, or the largest one if
+ * there is no such extent, in which case the caller calls again for the
+ * remaining blocks. Groups not read yet are loaded until one has room for the
+ * whole request, unless ALLOC_NOWAIT is set: then nothing is read and no
+ * memory allocation sleeps, and -EAGAIN is returned if the group of goal is
+ * not loaded. With ALLOC_RSV, the blocks are only taken out of the free
+ * extents and stay free in the bitmap, see rsv_claim().
+ * Return the number of blocks allocated, 0 if no free block was found.
+ */
+static long alloc_blocks(struct ouichefs_sb_info *sbi, uint32_t nr,
+			 uint32_t goal, uint32_t *bno, unsigned int flags)
+{
+	bool nowait = flags & ALLOC_NOWAIT;
+	struct ouichefs_free_extent *e, *spare;
+	struct ouichefs_bgroup *bg;
+	uint32_t start, len = 0;
+
+	if (!nr)
+		return 0;
+
+	if (!goal)
+		goal = this_cpu_read(*sbi->block_cursor);
+	if (goal >= sbi->nr_blocks)
+		goal = 0;
+	if (!nowait)
+		bgroup_load(sbi, bgroup(goal));
+	else if (!smp_load_acquire(&sbi->bfree_bh[bgroup(goal)]))
+		return -EAGAIN;
+
+	/* In case the goal is in the middle of an extent */
+	spare = kmem_cache_alloc(ouichefs_extent_cache,
+				 nowait ? GFP_NOWAIT : GFP_NOFS);
+
+retry:
+	if (smp_load_acquire(&sbi->bfree_bh[bgroup(goal)])) {
+		bg = &sbi->bgroups[bgroup(goal)];
+		spin_lock(&bg->lock);
+		e = ext_lookup(bg, goal);
+		if (e && goal < e->start + e->len &&
+		    (spare || goal == e->start)) {
+			start = goal;
+			len = min(nr, e->start + e->len - goal);
+			goto take;
+		}
+		spin_unlock(&bg->lock);
+	}
+
+	bg = bgroup_best_fit(sbi, nr);
+	if ((!bg || READ_ONCE(bg->largest) < nr) && !nowait &&
+	    READ_ONCE(sbi->nr_bgroups_loaded) < sbi->nr_bgroups) {
+		if (!bgroup_load_next(sbi, bgroup(goal)))
+			goto retry;
+		bg = bgroup_best_fit(sbi, nr);
+	}
+	if (!bg)
+		goto free_spare;
+
+	spin_lock(&bg->lock);
+	e = ext_best_fit(bg, nr);
+	if (e) {
+		start = e->start;
+		len = min(nr, e->len);
+	}
+
+take:
+	if (len) {
+		ext_take(bg, e, start, len, &spare);
+		/* Extents never cross a group, nor a bitmap block */
+		if (!(flags & ALLOC_RSV)) {
+			bitmap_clear(bitmap_bits(sbi->bfree_bh, bgroup(start)),
+				     start % OUICHEFS_BGROUP_BITS, len);
+			set_bit(bgroup(start), sbi->bfree_dirty);
+		}
+	}
+
+	spin_unlock(&bg->lock);
+
+free_spare:
+	if (spare)
+		kmem_cache_free(ouichefs_extent_cache, spare);
+	if (!len)
+		return 0;
+
+	bgroups_sub(sbi, start, len);
+	percpu_counter_sub(&sbi->free_blocks, len);
+	if (flags & ALLOC_RSV)
+		atomic_add(len, &sbi->nr_rsv_blocks);
+	this_cpu_write(*sbi->block_cursor, start + len);
+	*bno = start;
+
+	pr_debug("%s:%d: allocated blocks %u-%u\n", __func__, __LINE__, start,
+		 start + len - 1);
+
+	return len;
+}
+
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t nr,
+			 uint32_t goal, uint32_t *bno)
+{
+	return alloc_blocks(sbi, nr, goal, bno, 0);
+}
+
+/*
+ * Mark nr blocks from bno, all in group g, as unused, merging them with the
+ * free extents around them. The blocks of a reservation window are still
+ * free in the bitmap, only their extent is given back.
+ */
+static void bgroup_put_blocks(struct ouichefs_sb_info *sbi, uint32_t g,
+			      uint32_t bno, uint32_t nr, bool rsv)
+{
+	struct ouichefs_free_extent *prev, *next = NULL, *spare;
+	struct ouichefs_bgroup *bg = &sbi->bgroups[g];
+	uint32_t first = bno % OUICHEFS_BGROUP_BITS;
+	unsigned long *bits;
+	struct rb_node *n;
+
+	/* Never lose the blocks, free them once their group can be read */
+	if (bgroup_load(sbi, g) && bgroup_defer_free(sbi, bno, nr))
+		return;
+
+	spare = kmem_cache_alloc(ouichefs_extent_cache,
+				 GFP_NOFS | __GFP_NOFAIL);
+
+	spin_lock(&bg->lock);
+
+	bits = bitmap_bits(sbi->bfree_bh, g);
+	if (rsv) {
+		atomic_sub(nr, &sbi->nr_rsv_blocks);
+	} else if (find_next_bit(bits, first + nr, first) < first + nr) {
+		spin_unlock(&bg->lock);
+		kmem_cache_free(ouichefs_extent_cache, spare);
+		if (nr == 1) {
+			pr_err("block %u freed twice\n", bno);
+			return;
+		}
+		/* Free the blocks one at a time to skip the free ones */
+		while (nr--)
+			bgroup_put_blocks(sbi, g, bno++, 1, false);
+		return;
+	} else {
+		bitmap_set(bits, first, nr);
+		set_bit(g, sbi->bfree_dirty);
+	}
+
+	/* Neighbours, always in the same group */
+	prev = ext_lookup(bg, bno);
+	n = prev ? rb_next(&prev->by_start) : rb_first(&bg->by_start);
+	if (n)
+		next = by_start_entry(n);
+	if (prev && prev->start + prev->len != bno)
+		prev = NULL;
+	if (next && next->start != bno + nr)
+		next = NULL;
+
+	if (prev && next) {
+		ext_erase(bg, next);
+		ext_resize(bg, prev, prev->start, prev->len + nr + next->len);
+		kmem_cache_free(ouichefs_extent_cache, next);
+	} else if (prev) {
+		ext_resize(bg, prev, prev->start, prev->len + nr);
+	} else if (next) {
+		ext_resize(bg, next, bno, next->len + nr);
+	} else {
+		spare->start = bno;
+		spare->len = nr;
+		ext_insert(bg, spare);
+		spare = NULL;
+	}
+	ext_update_largest(bg);
+
+	spin_unlock(&bg->lock);
+
+	if (spare)
+		kmem_cache_free(ouichefs_extent_cache, spare);
+	atomic_add(nr, &sbi->bgroup_free[g]);
+	set_bit(g, sbi->bgroup_map);
+	percpu_counter_add(&sbi->free_blocks, nr);
+	pr_debug("%s:%d: freed blocks %u-%u\n", __func__, __LINE__, bno,
+		 bno + nr - 1);
+}
+
+/*
+ * Mark nr contiguous blocks from bno as unused, with one update of the free
+ * extents per group.
+ */
+void put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno, uint32_t nr)
+{
+	uint32_t g, len;
+
+	/* The blocks are out of the bitmap */
+	if (bno >= sbi->nr_blocks || nr > sbi->nr_blocks - bno)
+		return;
+
+	while (nr) {
+		g = bgroup(bno);
+		len = min(nr, (g + 1) * OUICHEFS_BGROUP_BITS - bno);
+		bgroup_put_blocks(sbi, g, bno, len, false);
+		bno += len;
+		nr -= len;
+	}
+}
+
+/*
+ * Per-inode reservation windows.
+ *
+ * A file claims a run of blocks ahead of its needs, and its next allocations
+ * are served from that run before the free extents are searched again. Files
+ * that grow at the same time then each fill their own run instead of
+ * interleaving their blocks. The window grows with the file and is kept in
+ * memory only: its blocks are taken out of the free extents but stay free in
+ * the bitmap until the file uses them, so that a crash never leaks them. They
+ * are given back when the last writer closes the file, unless they were
+ * asked for by fallocate(), or when the inode is evicted. The window is
+ * protected by index_sem.
+ */
+
+/*
+ * Mark nr blocks of a reservation window as used in the bitmap, now that the
+ * file uses them. A window never crosses a group.
+ */
+static void rsv_claim(struct ouichefs_sb_info *sbi, uint32_t bno, uint32_t nr)
+{
+	struct ouichefs_bgroup *bg = &sbi->bgroups[bgroup(bno)];
+
+	spin_lock(&bg->lock);
+	bitmap_clear(bitmap_bits(sbi->bfree_bh, bgroup(bno)),
+		     bno % OUICHEFS_BGROUP_BITS, nr);
+	set_bit(bgroup(bno), sbi->bfree_dirty);
+	spin_unlock(&bg->lock);
+	atomic_sub(nr, &sbi->nr_rsv_blocks);
+}
+
+/* Give the unused blocks of a reservation window back to the free extents */
+static void rsv_put(struct ouichefs_sb_info *sbi, uint32_t bno, uint32_t nr)
+{
+	if (nr)
+		bgroup_put_blocks(sbi, bgroup(bno), bno, nr, true);
+}
+
+/* Size of a new window, which never holds back much of the free space */
+static uint32_t rsv_size(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	uint32_t want;
+
+	want = clamp_t(uint32_t, inode->i_blocks, OUICHEFS_RSV_MIN,
+		       OUICHEFS_RSV_MAX);
+	return min_t(uint32_t, want,
+		     percpu_counter_read_positive(&sbi->free_blocks) / 16);
+}
+
+/*
+ * Allocate up to nr contiguous blocks for a file, from its reservation window,
+ * or from a new window claimed at goal once it is used up.
+ * Return the number of blocks allocated, starting at *bno, or 0 if no block
+ * is free.
+ */
+uint32_t ouichefs_rsv_alloc(struct inode *inode, uint32_t nr, uint32_t goal,
+			    uint32_t *bno)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	uint32_t len;
+
+	if (!nr)
+		return 0;
+
+	if (!ci->rsv_len) {
+		ci->rsv_keep = false;
+		ci->rsv_len = alloc_blocks(sbi, max(rsv_size(inode), nr), goal,
+					   &ci->rsv_start, ALLOC_RSV);
+		if (!ci->rsv_len)
+			return 0;
+	}
+
+	len = min(nr, ci->rsv_len);
+	*bno = ci->rsv_start;
+	rsv_claim(sbi, *bno, len);
+	ci->rsv_start += len;
+	ci->rsv_len -= len;
+
+	return len;
+}
+
+/*
+ * Make sure that the next nr blocks allocated for a file come from its
+ * reservation window, without sleeping, for IOCB_NOWAIT writes. A window is
+ * claimed at goal if the file has none.
+ * Return -EAGAIN if the window cannot hold them, or if claiming one would read
+ * a bitmap block.
+ */
+int ouichefs_rsv_tryreserve(struct inode *inode, uint32_t nr, uint32_t goal)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	long len;
+
+	if (ci->rsv_len >= nr)
+		return 0;
+	/* Giving the current window back may sleep */
+	if (ci->rsv_len)
+		return -EAGAIN;
+
+	len = alloc_blocks(sbi, max(rsv_size(inode), nr), goal,
+			   &ci->rsv_start, ALLOC_NOWAIT | ALLOC_RSV);
+	if (len < 0)
+		return len;
+	ci->rsv_len = len;
+
+	return ci->rsv_len >= nr ? 0 : -EAGAIN;
+}
+
+/*
+ * Make the reservation window of a file hold nr contiguous blocks, claimed at
+ * goal if the free extent there is large enough, else in the extent that fits
+ * best. A smaller run is kept if no free extent is large enough.
+ * Return -ENOSPC if there are not nr free blocks.
+ */
+int ouichefs_rsv_reserve(struct inode *inode, uint32_t nr, uint32_t goal)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	uint32_t bno, len;
+
+	if (ci->rsv_len >= nr)
+		return 0;
+
+	/* The old window usually merges back into the extent at goal */
+	ouichefs_rsv_release(inode);
+	if (nr > percpu_counter_read_positive(&sbi->free_blocks))
+		return -ENOSPC;
+
+	len = alloc_blocks(sbi, nr, goal, &bno, ALLOC_RSV);
+	if (len && len < nr) {
+		rsv_put(sbi, bno, len);
+		/* A goal in use makes the search pick the best fitting extent */
+		len = alloc_blocks(sbi, nr, ci->index_block, &bno, ALLOC_RSV);
+	}
+	if (!len)
+		return -ENOSPC;
+
+	ci->rsv_start = bno;
+	ci->rsv_len = len;
+
+	return 0;
+}
+
+/*
+ * Give the blocks left in the reservation window of a file back.
+ * index_sem must be held for writing, or the inode must be unused.
+ */
+void ouichefs_rsv_release(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	rsv_put(OUICHEFS_SB(inode->i_sb), ci->rsv_start, ci->rsv_len);
+	ci->rsv_len = 0;
+	ci->rsv_keep = false;
+}
+
+/*
+ * Fill a histogram of the free extents by length: bucket i counts the extents
+ * of 2^i to 2^(i+1) - 1 blocks. Only the groups read so far are counted.
+ */
+void ouichefs_free_info(struct ouichefs_sb_info *sbi, struct free_info *info)
+{
+	struct ouichefs_free_extent *e;
+	struct ouichefs_bgroup *bg;
+	struct rb_node *n;
+	uint32_t g;
+	int bucket;
+
+	memset(info->histogram, 0, sizeof(info->histogram));
+	info->nr_extents = 0;
+	info->largest = 0;
+
+	for (g = 0; g < sbi->nr_bgroups; g++) {
+		bg = &sbi->bgroups[g];
+		spin_lock(&bg->lock);
+		info->nr_extents += bg->nr_extents;
+		info->largest = max_t(int, info->largest, bg->largest);
+		for (n = rb_first(&bg->by_start); n; n = rb_next(n)) {
+			e = by_start_entry(n);
+			bucket = min(ilog2(e->len),
+				     OUICHEFS_FREE_HIST_SIZE - 1);
+			info->histogram[bucket]++;
+		}
+		spin_unlock(&bg->lock);
+	}
+
+	info->nr_free_blocks = percpu_counter_sum_positive(&sbi->free_blocks);
+}
+
+/*
+ * Return the first free block at or after from, or 0 if there is none. Only
+ * the groups read so far are searched.
+ */
+uint32_t first_free_block(struct ouichefs_sb_info *sbi, uint32_t from)
+{
+	struct ouichefs_free_extent *e;
+	struct ouichefs_bgroup *bg;
+	struct rb_node *n;
+	uint32_t g, bno = 0;
+
+	for (g = bgroup(from); g < sbi->nr_bgroups && !bno; g++) {
+		bg = &sbi->bgroups[g];
+		spin_lock(&bg->lock);
+		e = ext_lookup(bg, from);
+		if (e && from < e->start + e->len) {
+			bno = from;
+		} else {
+			n = e ? rb_next(&e->by_start) : rb_first(&bg->by_start);
+			if (n)
+				bno = by_start_entry(n)->start;
+		}
+		spin_unlock(&bg->lock);
+	}
+
+	return bno;
+}
+
+/*
+ * Read the bitmap blocks of all the groups that are not loaded yet.
+ */
+int ouichefs_alloc_load_all(struct ouichefs_sb_info *sbi)
+{
+	uint32_t g;
+	int ret;
+
+	for (g = 0; g < sbi->nr_bgroups; g++) {
+		ret = bgroup_load(sbi, g);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void ext_destroy(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_free_extent *e, *tmp;
+	uint32_t g;
+
+	for (g = 0; g < sbi->nr_bgroups; g++)
+		rbtree_postorder_for_each_entry_safe(
+			e, tmp, &sbi->bgroups[g].by_start, by_start)
+			kmem_cache_free(ouichefs_extent_cache, e);
+	kvfree(sbi->bgroups);
+	sbi->bgroups = NULL;
+}
+
+/*
+ * Read the bitmap blocks that are not loaded yet, submitting all the reads
+ * first. Run once after the mount so that allocations rarely wait for them.
+ */
+static void bitmap_prefetch(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, prefetch_work);
+	struct blk_plug plug;
+	uint32_t i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < sbi->nr_ifree_blocks; i++)
+		sb_breadahead(sbi->sb, ifree_first_block(sbi) + i);
+	for (i = 0; i < sbi->nr_bgroups; i++)
+		sb_breadahead(sbi->sb, bfree_first_block(sbi) + i);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
+		if (READ_ONCE(sbi->prefetch_stop))
+			return;
+		ifree_load(sbi, i);
+	}
+	for (i = 0; i < sbi->nr_bgroups; i++) {
+		if (READ_ONCE(sbi->prefetch_stop))
+			return;
+		bgroup_load(sbi, i);
+	}
+}
+
+static void bitmap_blocks_release(struct buffer_head **bhs,
+				  unsigned long *dirty, uint32_t nr)
+{
+	uint32_t i;
+
+	if (bhs)
+		for (i = 0; i < nr; i++)
+			brelse(bhs[i]);
+	kvfree(bhs);
+	bitmap_free(dirty);
+}
+
+/*
+ * Set up the free counts, the per-CPU cursors and the group summary, and
+ * start reading the bitmaps in the background. Nothing is read here, so that
+ * the mount time does not depend on the size of the volume.
+ */
+int ouichefs_alloc_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t i;
+	int cpu, ret = -ENOMEM;
+
+	sbi->sb = sb;
+	mutex_init(&sbi->bitmap_mutex);
+	sbi->nr_bgroups = DIV_ROUND_UP(sbi->nr_blocks, OUICHEFS_BGROUP_BITS);
+	sbi->nr_bgroups_loaded = 0;
+	INIT_LIST_HEAD(&sbi->deferred_frees);
+	atomic_set(&sbi->nr_rsv_blocks, 0);
+
+	sbi->ifree_bh = kvcalloc(sbi->nr_ifree_blocks,
+				 sizeof(struct buffer_head *), GFP_KERNEL);
+	sbi->ifree_dirty = bitmap_zalloc(sbi->nr_ifree_blocks, GFP_KERNEL);
+	sbi->bfree_bh = kvcalloc(sbi->nr_bfree_blocks,
+				 sizeof(struct buffer_head *), GFP_KERNEL);
+	sbi->bfree_dirty = bitmap_zalloc(sbi->nr_bfree_blocks, GFP_KERNEL);
+	sbi->bgroup_free =
+		kvcalloc(sbi->nr_bgroups, sizeof(atomic_t), GFP_KERNEL);
+	sbi->bgroup_map = bitmap_zalloc(sbi->nr_bgroups, GFP_KERNEL);
+	sbi->bgroups = kvcalloc(sbi->nr_bgroups, sizeof(*sbi->bgroups),
+				GFP_KERNEL);
+	if (!sbi->ifree_bh || !sbi->ifree_dirty || !sbi->bfree_bh ||
+	    !sbi->bfree_dirty || !sbi->bgroup_free || !sbi->bgroup_map ||
+	    !sbi->bgroups)
+		goto free_arrays;
+	for (i = 0; i < sbi->nr_bgroups; i++) {
+		spin_lock_init(&sbi->bgroups[i].lock);
+		sbi->bgroups[i].by_start = RB_ROOT;
+		sbi->bgroups[i].by_len = RB_ROOT;
+	}
+	/* Groups not read yet may have free blocks */
+	bitmap_fill(sbi->bgroup_map, sbi->nr_bgroups);
+
+	ret = percpu_counter_init(&sbi->free_inodes, sbi->nr_free_inodes,
+				  GFP_KERNEL);
+	if (ret)
+		goto free_arrays;
+	ret = percpu_counter_init(&sbi->free_blocks, sbi->nr_free_blocks,
+				  GFP_KERNEL);
+	if (ret)
+		goto destroy_free_inodes;
+
+	sbi->inode_cursor = alloc_percpu(uint32_t);
+	sbi->block_cursor = alloc_percpu(uint32_t);
+	if (!sbi->inode_cursor || !sbi->block_cursor) {
+		ret = -ENOMEM;
+		goto free_cursors;
+	}
+	/* Give each CPU its own slice of the bitmaps */
+	for_each_possible_cpu(cpu) {
+		*per_cpu_ptr(sbi->inode_cursor, cpu) =
+			div_u64((u64)sbi->nr_inodes * cpu, nr_cpu_ids);
+		*per_cpu_ptr(sbi->block_cursor, cpu) =
+			div_u64((u64)sbi->nr_blocks * cpu, nr_cpu_ids);
+	}
+
+	sbi->prefetch_stop = false;
+	INIT_WORK(&sbi->prefetch_work, bitmap_prefetch);
+	queue_work(system_unbound_wq, &sbi->prefetch_work);
+
+	return 0;
+
+free_cursors:
+	free_percpu(sbi->block_cursor);
+	free_percpu(sbi->inode_cursor);
+	percpu_counter_destroy(&sbi->free_blocks);
+destroy_free_inodes:
+	percpu_counter_destroy(&sbi->free_inodes);
+free_arrays:
+	kvfree(sbi->bgroups);
+	bitmap_free(sbi->bgroup_map);
+	kvfree(sbi->bgroup_free);
+	bitmap_blocks_release(sbi->bfree_bh, sbi->bfree_dirty,
+			      sbi->nr_bfree_blocks);
+	bitmap_blocks_release(sbi->ifree_bh, sbi->ifree_dirty,
+			      sbi->nr_ifree_blocks);
+
+	return ret;
+}
+
+void ouichefs_alloc_free(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_deferred_free *df, *tmp;
+
+	WRITE_ONCE(sbi->prefetch_stop, true);
+	cancel_work_sync(&sbi->prefetch_work);
+
+	list_for_each_entry_safe(df, tmp, &sbi->deferred_frees, list) {
+		pr_err("blocks %u-%u could not be freed\n", df->start,
+		       df->start + df->len - 1);
+		kfree(df);
+	}
+	ext_destroy(sbi);
+	bitmap_free(sbi->bgroup_map);
+	kvfree(sbi->bgroup_free);
+	free_percpu(sbi->block_cursor);
+	free_percpu(sbi->inode_cursor);
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+	bitmap_blocks_release(sbi->bfree_bh, sbi->bfree_dirty,
+			      sbi->nr_bfree_blocks);
+	bitmap_blocks_release(sbi->ifree_bh, sbi->ifree_dirty,
+			      sbi->nr_ifree_blocks);
+}
@@ -9,100 +9,68 @@
 
 #include "linux/fs.h"
 #include <linux/bitmap.h>
+#include <linux/buffer_head.h>
 #include "ouichefs.h"
 
-/*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
- * Return 0 if no free bit found (we assume that the first bit is never free
- * because of the superblock and the root inode, thus allowing us to use 0 as an
- * error value).
- */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
-{
-	uint32_t ino;
-
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
-		return 0;
-
-	bitmap_clear(freemap, ino, 1);
-
-	return ino;
-}
-
-/*
- * Return an unused inode number and mark it used.
- * Return 0 if no free inode was found.
- */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
-{
-	uint32_t ret;
-
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
-		sbi->nr_free_inodes--;
-		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
-			 ret);
-	}
-	return ret;
-}
+/* Block and inode allocators, see bitmap.c */
+int ouichefs_alloc_init(struct super_block *sb);
+void ouichefs_alloc_free(struct ouichefs_sb_info *sbi);
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi);
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino);
+bool inode_in_use(struct ouichefs_sb_info *sbi, uint32_t ino);
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t nr,
+			 uint32_t goal, uint32_t *bno);
+void put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno, uint32_t nr);
+uint32_t ouichefs_rsv_alloc(struct inode *inode, uint32_t nr, uint32_t goal,
+			    uint32_t *bno);
+int ouichefs_rsv_reserve(struct inode *inode, uint32_t nr, uint32_t goal);
+int ouichefs_rsv_tryreserve(struct inode *inode, uint32_t nr, uint32_t goal);
+void ouichefs_rsv_release(struct inode *inode);
+uint32_t first_free_block(struct ouichefs_sb_info *sbi, uint32_t from);
+int ouichefs_alloc_load_all(struct ouichefs_sb_info *sbi);
+struct free_info;
+void ouichefs_free_info(struct ouichefs_sb_info *sbi, struct free_info *info);
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number and mark it used. The search starts at goal,
+ * or where the previous one stopped if goal is 0.
  * Return 0 if no free block was found.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	uint32_t ret;
+	uint32_t bno;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
-		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
-			 ret);
-	}
-	return ret;
+	if (!get_free_blocks(sbi, 1, goal, &bno))
+		return 0;
+	return bno;
 }
 
 /*
- * Mark the i-th bit in freemap as free (i.e. 1)
+ * Mark a block as unused.
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	/* i is greater than freemap size */
-	if (i > size)
-		return -1;
-
-	bitmap_set(freemap, i, 1);
-
-	return 0;
+	put_blocks(sbi, bno, 1);
 }
 
 /*
- * Mark an inode as unused.
+ * Mark nr blocks whose content is not needed anymore as unused. Their buffers
+ * are dropped so that the old content is never written over their next owner.
  */
-static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+static inline void forget_blocks(struct super_block *sb, uint32_t bno,
+				 uint32_t nr)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
-		return;
+	uint32_t i;
 
-	sbi->nr_free_inodes++;
-	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
+	for (i = 0; i < nr; i++)
+		bforget(sb_find_get_block(sb, bno + i));
+	put_blocks(OUICHEFS_SB(sb), bno, nr);
 }
 
-/*
- * Mark a block as unused.
- */
-static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+static inline void forget_block(struct super_block *sb, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
-		return;
-
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	forget_blocks(sb, bno, 1);
 }
 
 /*
@@ -179,4 +147,120 @@ static inline void add_block_size(int *block, int value)
 	set_block_size(block, new_size);
 }
 
+/*
+ * Offset of the first byte of the bli-th slice of a file in its block.
+ */
+static inline int get_slice_start(struct inode *inode, int bli)
+{
+	uint16_t *starts = OUICHEFS_INODE(inode)->starts;
+
+	return starts ? starts[bli] : 0;
+}
+
+/*
+ * Set the offset of the bli-th slice of a file in its block. The file must
+ * have a start block unless start is 0.
+ */
+static inline void set_slice_start(struct inode *inode, int bli, int start)
+{
+	uint16_t *starts = OUICHEFS_INODE(inode)->starts;
+
+	if (starts)
+		starts[bli] = start;
+}
+
+/*
+ * Return true if another slice of the file is in the block of the bli-th one.
+ * Only files with a start block share blocks between their slices.
+ */
+static inline bool slice_shared(struct inode *inode,
+				struct ouichefs_file_index_block *index,
+				int bli)
+{
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, i;
+	uint32_t bno = get_block_number(index->blocks[bli]);
+
+	if (!OUICHEFS_INODE(inode)->starts)
+		return false;
+	for (i = 0; i < nb_blocks; i++)
+		if (i != bli && index->blocks[i] &&
+		    get_block_number(index->blocks[i]) == bno)
+			return true;
+	return false;
+}
+
+/*
+ * Number of bytes the bli-th slice of a file can grow by without moving. The
+ * end of a block shared with other slices is not the slice's to use.
+ */
+static inline int slice_room(struct inode *inode,
+			     struct ouichefs_file_index_block *index, int bli)
+{
+	if (!index->blocks[bli] || slice_shared(inode, index, bli))
+		return 0;
+	return OUICHEFS_BLOCK_SIZE - get_slice_start(inode, bli) -
+	       get_block_size(index->blocks[bli]);
+}
+
+/*
+ * Entries listed by ouichefs_sort_slices(): the block number of a slice,
+ * shifted left by SORTED_BLI_BITS, then its entry number.
+ */
+#define SORTED_BLI_BITS 10
+
+static inline uint32_t sorted_bno(uint32_t sorted)
+{
+	return sorted >> SORTED_BLI_BITS;
+}
+
+static inline int sorted_bli(uint32_t sorted)
+{
+	return sorted & ((1 << SORTED_BLI_BITS) - 1);
+}
+
+/*
+ * Position of the first slice in block bno among nr sorted entries, or the
+ * position it would be inserted at if no slice is in it.
+ */
+static inline int sorted_first(const uint32_t *sorted, int nr, uint32_t bno)
+{
+	int low = 0, high = nr, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (sorted_bno(sorted[mid]) < bno)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Goal of the allocation of the bli-th block of a file: right after the
+ * previous block of the file if it is allocated, else after the last block
+ * allocated to the file.
+ */
+static inline uint32_t get_alloc_goal(struct inode *inode,
+				      struct ouichefs_file_index_block *index,
+				      int bli)
+{
+	if (bli > 0 && index->blocks[bli - 1] != 0)
+		return get_block_number(index->blocks[bli - 1]) + 1;
+	return OUICHEFS_INODE(inode)->alloc_hint;
+}
+
+/*
+ * Return true if the file was written by the insert-aware write path. Its
+ * blocks carry a size and may be partially filled, so the page cache cannot
+ * map page N to block N. The first block of a non-empty sliced file is never
+ * empty.
+ */
+static inline bool
+ouichefs_index_sliced(struct ouichefs_file_index_block *index, int nb_blocks)
+{
+	return nb_blocks > 0 && !block_empty(index->blocks[0]);
+}
+
 #endif /* _OUICHEFS_BITMAP_H */
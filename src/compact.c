@@ -0,0 +1,398 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include "linux/buffer_head.h"
+#include "linux/mm.h"
+#include "linux/sched/signal.h"
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "ioctl.h"
+
+/*
+ * Free space compaction
+ *
+ * Used blocks are moved from the end of the volume to the first free blocks,
+ * so that the free space gathers in large extents at the end. The owner of
+ * each block is found in a reverse map built from the inode store when the
+ * compaction starts. Files keep changing while it runs, so the owner of a
+ * block is checked again, under the inode lock, before the block is moved.
+ */
+
+/* Record the owner of a block in the reverse map */
+static void rmap_set(struct ouichefs_sb_info *sbi, uint32_t *rmap,
+		     uint32_t bno, uint32_t ino)
+{
+	if (bno && bno < sbi->nr_blocks)
+		rmap[bno] = ino;
+}
+
+/* Record the blocks of a file from its index block */
+static void rmap_set_index(struct ouichefs_sb_info *sbi, uint32_t *rmap,
+			   struct ouichefs_file_index_block *index,
+			   uint32_t ino)
+{
+	int bli;
+
+	for (bli = 0; bli < OUICHEFS_BLOCK_SIZE >> 2; bli++)
+		if (index->blocks[bli])
+			rmap_set(sbi, rmap,
+				 get_block_number(index->blocks[bli]), ino);
+}
+
+/*
+ * Record the blocks of the inode ino in the reverse map: its index block, or
+ * the block of a directory, and the start and data blocks of a regular file.
+ * The in-memory inode and index are used when they are cached, disk_inode
+ * otherwise.
+ */
+static int rmap_add_inode(struct super_block *sb, uint32_t ino,
+			  struct ouichefs_inode *disk_inode, void *data)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t *rmap = data;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint32_t mode, nlink, index_block, start_block;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		mode = inode->i_mode;
+		nlink = inode->i_nlink;
+		index_block = OUICHEFS_INODE(inode)->index_block;
+		start_block = OUICHEFS_INODE(inode)->start_block;
+	} else {
+		mode = le32_to_cpu(disk_inode->i_mode);
+		nlink = le32_to_cpu(disk_inode->i_nlink);
+		index_block = le32_to_cpu(disk_inode->index_block);
+		start_block = le32_to_cpu(disk_inode->start_block);
+	}
+
+	if (!nlink || !(S_ISREG(mode) || S_ISDIR(mode)))
+		goto iput;
+	rmap_set(sbi, rmap, index_block, ino);
+	if (!S_ISREG(mode))
+		goto iput;
+	rmap_set(sbi, rmap, start_block, ino);
+
+	if (inode) {
+		index = ouichefs_index_get(inode, false);
+		if (IS_ERR(index)) {
+			iput(inode);
+			return PTR_ERR(index);
+		}
+		rmap_set_index(sbi, rmap, index, ino);
+		ouichefs_index_put(inode, false);
+	} else {
+		bh = sb_bread(sb, index_block);
+		if (!bh)
+			return -EIO;
+		rmap_set_index(sbi, rmap,
+			       (struct ouichefs_file_index_block *)bh->b_data,
+			       ino);
+		brelse(bh);
+	}
+
+iput:
+	iput(inode);
+
+	return 0;
+}
+
+/*
+ * Build the reverse map of the volume: rmap[bno] is the inode that owns the
+ * block bno, or 0 for free blocks and metadata.
+ */
+static int rmap_build(struct super_block *sb, uint32_t *rmap)
+{
+	return ouichefs_for_each_inode(sb, rmap_add_inode, rmap);
+}
+
+/*
+ * Copy the block from to the block to, and drop the buffer of from so that
+ * its old content is never written back over a new owner. With sync, the
+ * block to is written before returning, for the readers that go to the
+ * device rather than to the buffers.
+ */
+static int compact_copy(struct inode *inode, uint32_t from, uint32_t to,
+			bool sync)
+{
+	struct buffer_head *bh_from, *bh_to;
+	int ret = 0;
+
+	bh_from = sb_bread(inode->i_sb, from);
+	if (!bh_from)
+		return -EIO;
+	bh_to = ouichefs_getblk_new(inode->i_sb, to);
+	if (!bh_to) {
+		brelse(bh_from);
+		return -ENOMEM;
+	}
+
+	memcpy(bh_to->b_data, bh_from->b_data, OUICHEFS_BLOCK_SIZE);
+	mark_buffer_dirty_inode(bh_to, inode);
+	if (sync)
+		ret = sync_dirty_buffer(bh_to);
+	brelse(bh_to);
+	if (ret) {
+		brelse(bh_from);
+		return ret;
+	}
+	bforget(bh_from);
+
+	return 0;
+}
+
+/*
+ * Move the index or start block of a file, or the block of a directory.
+ * Return -EAGAIN if the inode no longer owns the block.
+ */
+static int compact_move_meta(struct inode *inode, uint32_t from, uint32_t to)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index = NULL;
+	uint32_t *meta;
+	int ret;
+
+	/* Keep the cached index from being written back to the old block */
+	if (S_ISREG(inode->i_mode)) {
+		index = ouichefs_index_get(inode, true);
+		if (IS_ERR(index))
+			return PTR_ERR(index);
+	}
+
+	if (ci->index_block == from) {
+		meta = &ci->index_block;
+	} else if (S_ISREG(inode->i_mode) && ci->start_block == from) {
+		meta = &ci->start_block;
+	} else {
+		ret = -EAGAIN;
+		goto put_index;
+	}
+	ret = compact_copy(inode, from, to, false);
+	if (ret)
+		goto put_index;
+
+	*meta = to;
+	mark_inode_dirty(inode);
+	put_block(OUICHEFS_SB(inode->i_sb), from);
+
+put_index:
+	if (index)
+		ouichefs_index_put(inode, true);
+
+	return ret;
+}
+
+/* Return the index entry that maps the block bno, or -1 */
+static int compact_find_entry(struct ouichefs_file_index_block *index,
+			      uint32_t bno)
+{
+	int bli;
+
+	for (bli = 0; bli < OUICHEFS_BLOCK_SIZE >> 2; bli++)
+		if (index->blocks[bli] &&
+		    get_block_number(index->blocks[bli]) == bno)
+			return bli;
+	return -1;
+}
+
+/*
+ * Move a data block of a regular file.
+ * Return -EAGAIN if the file no longer owns the block.
+ */
+static int compact_move_data(struct inode *inode, uint32_t from, uint32_t to)
+{
+	struct ouichefs_file_index_block *index;
+	pgoff_t page;
+	bool sliced;
+	int bli, ret;
+
+	/* Keep faults and readahead from mapping the block until it moved */
+	filemap_invalidate_lock(inode->i_mapping);
+
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+		goto unlock;
+	}
+	bli = compact_find_entry(index, from);
+	sliced = ouichefs_index_sliced(index,
+				       OUICHEFS_INODE(inode)->nr_slices);
+	ouichefs_index_put(inode, false);
+	if (bli < 0) {
+		ret = -EAGAIN;
+		goto unlock;
+	}
+
+	/*
+	 * The cached pages of files written through the page cache are mapped
+	 * to the block, write the one of this block back and drop it.
+	 */
+	if (!sliced) {
+		page = ((loff_t)bli * OUICHEFS_BLOCK_SIZE) >> PAGE_SHIFT;
+		ret = filemap_write_and_wait_range(
+			inode->i_mapping, (loff_t)bli * OUICHEFS_BLOCK_SIZE,
+			(loff_t)(bli + 1) * OUICHEFS_BLOCK_SIZE - 1);
+		if (!ret)
+			ret = invalidate_inode_pages2_range(inode->i_mapping,
+							    page, page);
+		if (ret)
+			goto unlock;
+	}
+
+	index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+		goto unlock;
+	}
+
+	if (!index->blocks[bli] ||
+	    get_block_number(index->blocks[bli]) != from) {
+		ret = -EAGAIN;
+		goto put_index;
+	}
+	/* The page cache reads the block from the device once it moved */
+	ret = compact_copy(inode, from, to, !sliced);
+	if (ret)
+		goto put_index;
+
+	/* The slices of a split slice share the block */
+	for (; bli < OUICHEFS_BLOCK_SIZE >> 2; bli++)
+		if (index->blocks[bli] &&
+		    get_block_number(index->blocks[bli]) == from)
+			set_block_number(&index->blocks[bli], to);
+	ouichefs_index_mark_dirty(inode);
+	put_block(OUICHEFS_SB(inode->i_sb), from);
+
+put_index:
+	ouichefs_index_put(inode, true);
+unlock:
+	filemap_invalidate_unlock(inode->i_mapping);
+
+	return ret;
+}
+
+/*
+ * Move the block from, owned by the inode ino, to the first free block at or
+ * after goal. Return the block it was moved to, 0 if it was not moved because
+ * its owner changed, or an error. -ENOSPC means there is no free block before
+ * from anymore.
+ */
+static long compact_move(struct super_block *sb, uint32_t ino, uint32_t from,
+			 uint32_t goal)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct inode *inode;
+	uint32_t to = 0;
+	long ret;
+
+	inode = ouichefs_iget(sb, ino);
+	if (IS_ERR(inode))
+		return 0;
+	inode_lock(inode);
+
+	if (!inode->i_nlink || !inode_in_use(sbi, ino) ||
+	    !(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode))) {
+		ret = 0;
+		goto unlock;
+	}
+
+	to = get_free_block(sbi, goal);
+	if (!to || to >= from) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	if (OUICHEFS_INODE(inode)->index_block == from ||
+	    OUICHEFS_INODE(inode)->start_block == from)
+		ret = compact_move_meta(inode, from, to);
+	else if (S_ISREG(inode->i_mode))
+		ret = compact_move_data(inode, from, to);
+	else
+		ret = -EAGAIN;
+
+	if (ret == -EAGAIN)
+		ret = 0;
+	else if (!ret)
+		ret = to;
+
+unlock:
+	/* The block was not used, a failed copy may have left it dirty */
+	if (to && ret <= 0)
+		forget_block(sb, to);
+	inode_unlock(inode);
+	iput(inode);
+
+	return ret;
+}
+
+/*
+ * Move used blocks from the end of the volume to the first free blocks, at
+ * most info->max_moves of them (0 for no limit), and report the free extents
+ * before and after.
+ */
+int ouichefs_compact(struct super_block *sb, struct compact_info *info)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct free_info fi;
+	uint32_t *rmap, lo, hi;
+	long ret;
+
+	if (info->max_moves < 0)
+		return -EINVAL;
+
+	/* All the free extents are needed to find the first free block */
+	ret = ouichefs_alloc_load_all(sbi);
+	if (ret)
+		return ret;
+
+	ouichefs_free_info(sbi, &fi);
+	info->nr_extents_before = fi.nr_extents;
+	info->largest_before = fi.largest;
+	info->nr_moved = 0;
+
+	rmap = kvcalloc(sbi->nr_blocks, sizeof(*rmap), GFP_KERNEL);
+	if (!rmap)
+		return -ENOMEM;
+	ret = rmap_build(sb, rmap);
+	if (ret)
+		goto free_rmap;
+
+	hi = sbi->nr_blocks - 1;
+	while (!info->max_moves || info->nr_moved < info->max_moves) {
+		lo = first_free_block(sbi, 0);
+		while (hi > lo && !rmap[hi])
+			hi--;
+		if (!lo || hi <= lo)
+			break;
+
+		ret = compact_move(sb, rmap[hi], hi, lo);
+		if (ret == -ENOSPC) {
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			goto free_rmap;
+		if (ret) {
+			rmap[ret] = rmap[hi];
+			info->nr_moved++;
+		}
+		rmap[hi] = 0;
+		ret = 0;
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	ouichefs_free_info(sbi, &fi);
+	info->nr_extents_after = fi.nr_extents;
+	info->largest_after = fi.largest;
+
+free_rmap:
+	kvfree(rmap);
+
+	return ret;
+}
@@ -25,15 +25,20 @@ static ssize_t read_fn_store(struct kobject *kobj, struct kobj_attribute *attr,
 	switch (buf[0]) {
 	case DEFAULT_READ:
 		ouichefs_file_ops.read = NULL;
+		ouichefs_file_ops.read_iter = generic_file_read_iter;
 		break;
 	case SIMPLE_READ:
 		ouichefs_file_ops.read = ouichefs_read;
+		ouichefs_file_ops.read_iter = generic_file_read_iter;
 		break;
 	case LIGHT_READ:
-		ouichefs_file_ops.read = ouichefs_light_read;
+		/* Also serves readv() and io_uring */
+		ouichefs_file_ops.read = NULL;
+		ouichefs_file_ops.read_iter = ouichefs_light_read_iter;
 		break;
 	case PAGE_READ:
 		ouichefs_file_ops.read = ouichefs_read_cached;
+		ouichefs_file_ops.read_iter = generic_file_read_iter;
 		break;
 	default:
 		pr_err("Invalid read fn code\n");
@@ -56,12 +61,16 @@ static ssize_t write_fn_store(struct kobject *kobj, struct kobj_attribute *attr,
 	switch (buf[0]) {
 	case DEFAULT_WRITE:
 		ouichefs_file_ops.write = NULL;
+		ouichefs_file_ops.write_iter = generic_file_write_iter;
 		break;
 	case SIMPLE_WRITE:
 		ouichefs_file_ops.write = ouichefs_write;
+		ouichefs_file_ops.write_iter = generic_file_write_iter;
 		break;
 	case LIGHT_WRITE:
-		ouichefs_file_ops.write = ouichefs_light_write;
+		/* Also serves writev() and io_uring */
+		ouichefs_file_ops.write = NULL;
+		ouichefs_file_ops.write_iter = ouichefs_light_write_iter;
 		break;
 	default:
 		pr_err("Invalid write fn code\n");
@@ -78,6 +87,51 @@ static ssize_t write_fn_show(struct kobject *kobj, struct kobj_attribute *attr,
 	return snprintf(buf, PAGE_SIZE, "%c\n", write_fn);
 }
 
+/* Background defrag knobs, in /sys/kernel/ouichefs/defrag */
+
+#define DEFRAG_PARAM_ATTR(name)						\
+static ssize_t name##_store(struct kobject *kobj,			\
+			    struct kobj_attribute *attr,		\
+			    const char *buf, size_t count)		\
+{									\
+	unsigned int val;						\
+	int ret = kstrtouint(buf, 0, &val);				\
+									\
+	if (ret)							\
+		return ret;						\
+	WRITE_ONCE(ouichefs_defrag_params.name, val);			\
+	return count;							\
+}									\
+									\
+static ssize_t name##_show(struct kobject *kobj,			\
+			   struct kobj_attribute *attr, char *buf)	\
+{									\
+	return snprintf(buf, PAGE_SIZE, "%u\n",				\
+			READ_ONCE(ouichefs_defrag_params.name));	\
+}									\
+									\
+static struct kobj_attribute name##_attr = __ATTR_RW(name)
+
+DEFRAG_PARAM_ATTR(enabled);
+DEFRAG_PARAM_ATTR(min_waste);
+DEFRAG_PARAM_ATTR(min_partial);
+DEFRAG_PARAM_ATTR(idle_ms);
+DEFRAG_PARAM_ATTR(rate);
+
+static struct attribute *defrag_attrs[] = {
+	&enabled_attr.attr,
+	&min_waste_attr.attr,
+	&min_partial_attr.attr,
+	&idle_ms_attr.attr,
+	&rate_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group defrag_attr_group = {
+	.name = "defrag",
+	.attrs = defrag_attrs,
+};
+
 extern struct kobject *kernel_kobj;
 static struct kobj_attribute read_fn_attr = __ATTR_RW(read_fn);
 static struct kobj_attribute write_fn_attr = __ATTR_RW(write_fn);
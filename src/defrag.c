@@ -3,146 +3,999 @@
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
 #include "linux/buffer_head.h"
+#include "linux/slab.h"
+#include "linux/sched/signal.h"
+#include "linux/sort.h"
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "ioctl.h"
 
 /*
- * Move content from the beginning of a block (block_index_from),
- * up to a length fitting in a target block (block_index_to), starting at
- * logical_pos. Also, shift up any remaining data in the source block.
+ * Defragmentation
+ *
+ * The slices of the file are read in order, OUICHEFS_READ_BATCH blocks at a
+ * time, and their data is packed into a staging block. Each time the staging
+ * block is full, it is copied to the next destination, which is the next
+ * block of the index. Data only moves towards the start of the file, so a
+ * block is only overwritten once all its data has been consumed, and each
+ * block is read and written at most once. The blocks left empty at the end
+ * are then freed.
+ *
+ * The slices of a split slice share their block. When the block of a
+ * destination still holds data that is not consumed yet, or that was packed
+ * already, the destination is written to a new block instead.
  */
-int move_shift_block_content_to(struct ouichefs_file_index_block *index,
-				struct super_block *sb, int block_index_from,
-				int block_index_to, int logical_pos)
+
+struct defrag_state {
+	struct inode *inode;
+	struct ouichefs_file_index_block *index;
+	char *stage; /* Data of the destination block being filled */
+	int fill; /* Number of bytes in stage */
+	int dst; /* Index entry of the destination block being filled */
+	int next; /* Index entry of the slice being consumed */
+	int nr_written; /* Number of destination blocks written */
+	struct buffer_head *bh_dst[2]; /* Buffers of dst and dst + 1 */
+	uint32_t new_bno[2]; /* New blocks of dst and dst + 1, or 0 */
+	uint32_t *sorted; /* Entries by block, NULL if no block is shared */
+	int nr_sorted; /* Number of entries in sorted */
+};
+
+/*
+ * Return true if the block of the destination entry d holds data of another
+ * slice that must be kept: a slice packed before it, or a slice that is not
+ * consumed yet.
+ */
+static bool defrag_dst_shared(struct defrag_state *ds, int d)
 {
-	struct buffer_head *bh_data_from, *bh_data_to;
-	int from_len, to_available_len, to_copy;
+	uint32_t bno = get_block_number(ds->index->blocks[d]);
+	int i, j;
 
-	/* Get the size to copy, should fit in destination block. */
-	from_len = get_block_size(index->blocks[block_index_from]);
-	to_available_len = OUICHEFS_BLOCK_SIZE - logical_pos;
-	to_copy = min(from_len, to_available_len);
-	if (to_copy == 0)
-		return 0;
+	if (!ds->sorted)
+		return false;
 
-	bh_data_from =
-		sb_bread(sb, get_block_number(index->blocks[block_index_from]));
-	bh_data_to =
-		sb_bread(sb, get_block_number(index->blocks[block_index_to]));
-	if (!bh_data_from || !bh_data_to)
-		return -EIO;
+	/*
+	 * The entries were sorted before packing started. Packing only moves
+	 * entries to new blocks, so the slices in bno are all listed.
+	 */
+	for (i = sorted_first(ds->sorted, ds->nr_sorted, bno);
+	     i < ds->nr_sorted && sorted_bno(ds->sorted[i]) == bno; i++) {
+		j = sorted_bli(ds->sorted[i]);
+		if (j == d || (j > d && j < ds->next))
+			continue;
+		if (j > d && block_empty(ds->index->blocks[j]))
+			continue;
+		if (get_block_number(ds->index->blocks[j]) == bno)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return true if the block of the non-empty entry bli holds another slice.
+ */
+static bool defrag_block_shared(struct defrag_state *ds, int bli)
+{
+	uint32_t bno = get_block_number(ds->index->blocks[bli]);
+	int i;
+
+	if (!ds->sorted)
+		return false;
+	i = sorted_first(ds->sorted, ds->nr_sorted, bno);
+	return i + 1 < ds->nr_sorted && sorted_bno(ds->sorted[i + 1]) == bno;
+}
+
+/*
+ * Get the buffers of the destination blocks the next size bytes go to, so
+ * that a slice is either consumed entirely or not at all. A destination whose
+ * block is shared gets a new block, which replaces the old one in the index
+ * once the destination is written.
+ */
+static int defrag_get_dst(struct defrag_state *ds, int size)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(ds->inode->i_sb);
+	int i, d, nr = ds->fill + size > OUICHEFS_BLOCK_SIZE ? 2 : 1;
+	uint32_t bno;
+
+	for (i = 0; i < nr; i++) {
+		if (ds->bh_dst[i])
+			continue;
+		d = ds->dst + i;
+		bno = get_block_number(ds->index->blocks[d]);
+		if (defrag_dst_shared(ds, d)) {
+			bno = get_free_block(sbi, get_alloc_goal(ds->inode,
+								 ds->index, d));
+			if (!bno)
+				return -ENOSPC;
+			ds->new_bno[i] = bno;
+		}
+		ds->bh_dst[i] = sb_getblk(ds->inode->i_sb, bno);
+		if (!ds->bh_dst[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Release the destination buffers, and the new blocks that were not written.
+ */
+static void defrag_put_dst(struct defrag_state *ds)
+{
+	int i;
 
-	/* Move data from source block to destination. */
-	memcpy(bh_data_to->b_data + logical_pos, bh_data_from->b_data, to_copy);
-	sub_block_size(&index->blocks[block_index_from], to_copy);
-	add_block_size(&index->blocks[block_index_to], to_copy);
+	for (i = 0; i < 2; i++) {
+		brelse(ds->bh_dst[i]);
+		ds->bh_dst[i] = NULL;
+		if (ds->new_bno[i])
+			put_block(OUICHEFS_SB(ds->inode->i_sb),
+				  ds->new_bno[i]);
+		ds->new_bno[i] = 0;
+	}
+}
 
-	/* Shift up any remaining data in source block. */
-	memcpy(bh_data_from->b_data, bh_data_from->b_data + to_copy,
-	       from_len - to_copy);
-	memset(bh_data_from->b_data + (from_len - to_copy), 0, to_copy);
+/*
+ * Copy the staging block to its destination and move to the next one.
+ */
+static void defrag_flush(struct defrag_state *ds)
+{
+	struct buffer_head *bh = ds->bh_dst[0];
 
-	mark_buffer_dirty(bh_data_from);
-	sync_dirty_buffer(bh_data_from);
-	mark_buffer_dirty(bh_data_to);
-	sync_dirty_buffer(bh_data_to);
-	brelse(bh_data_from);
-	brelse(bh_data_to);
+	lock_buffer(bh);
+	memcpy(bh->b_data, ds->stage, ds->fill);
+	memset(bh->b_data + ds->fill, 0, OUICHEFS_BLOCK_SIZE - ds->fill);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, ds->inode);
+	brelse(bh);
 
-	return to_copy;
+	/* The old block is kept for the other slices in it */
+	if (ds->new_bno[0]) {
+		set_block_number(&ds->index->blocks[ds->dst], ds->new_bno[0]);
+		ds->inode->i_blocks++;
+	}
+	set_block_size(&ds->index->blocks[ds->dst], ds->fill);
+	set_slice_start(ds->inode, ds->dst, 0);
+	ds->bh_dst[0] = ds->bh_dst[1];
+	ds->bh_dst[1] = NULL;
+	ds->new_bno[0] = ds->new_bno[1];
+	ds->new_bno[1] = 0;
+	ds->dst++;
+	ds->fill = 0;
+	ds->nr_written++;
 }
 
 /*
- * Bubble up a block at block_index to the end of the index list.
+ * Append the data of a slice to the staging block.
  */
-void bubble_up_block(struct ouichefs_file_index_block *index, int block_index,
-		     int nb_blocks)
+static void defrag_consume(struct defrag_state *ds, const char *data,
+			   int size)
 {
-	int tmp;
+	int len;
 
-	for (int bli = block_index; bli < nb_blocks - 1; bli++) {
-		tmp = index->blocks[bli];
-		index->blocks[bli] = index->blocks[bli + 1];
-		index->blocks[bli + 1] = tmp;
+	while (size > 0) {
+		len = min(size, OUICHEFS_BLOCK_SIZE - ds->fill);
+		memcpy(ds->stage + ds->fill, data, len);
+		ds->fill += len;
+		data += len;
+		size -= len;
+		if (ds->fill == OUICHEFS_BLOCK_SIZE)
+			defrag_flush(ds);
+	}
+}
+
+/*
+ * Pack the slices of a file from index entry step->cursor onward, reading at
+ * most max blocks (0 for no limit), and free the blocks left empty once the
+ * end of the file is reached. If the file was written since the cursor was
+ * returned, packing starts again at the first entry before the cursor that is
+ * not a full block of its own. The slices that were not reached, or that could
+ * not be read, are left as they are, so the file is consistent after each
+ * call. The counters of step are increased, and its cursor is set to the first
+ * entry that is not a full packed block. The inode must be locked.
+ */
+static int defrag_chunk(struct inode *inode, struct defrag_step *step,
+			int max)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bhs[OUICHEFS_READ_BATCH];
+	uint32_t bnos[OUICHEFS_READ_BATCH];
+	int slots[OUICHEFS_READ_BATCH];
+	struct defrag_state ds = { .inode = inode };
+	int nb_blocks, bli, end, nr, i, nr_read = 0, blocks_freed = 0,
+	    ret = 0;
+
+	ds.stage = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!ds.stage)
+		return -ENOMEM;
+
+	/* Get the cached index block */
+	ds.index = ouichefs_index_get(inode, true);
+	if (IS_ERR(ds.index)) {
+		ret = PTR_ERR(ds.index);
+		goto free_stage;
+	}
+	ouichefs_offsets_invalidate(inode, 0);
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
+
+	/* Files written through the page cache have no slices to pack */
+	if (!ouichefs_index_sliced(ds.index, nb_blocks)) {
+		step->cursor = nb_blocks;
+		step->done = 1;
+		goto put_index;
+	}
+
+	/* Only the slices of files with a start block share blocks */
+	if (OUICHEFS_INODE(inode)->starts) {
+		ds.nr_sorted = ouichefs_sort_slices(inode, ds.index,
+						    &ds.sorted);
+		if (ds.nr_sorted < 0) {
+			ret = ds.nr_sorted;
+			goto put_index;
+		}
+	}
+
+	/*
+	 * Full slices sharing their block, such as the zeros of an inserted
+	 * range, are not packed yet: their block must not be left shared once
+	 * the starts are released.
+	 */
+	end = min_t(int, step->cursor, nb_blocks);
+	for (bli = 0; bli < end; bli++)
+		if (get_block_size(ds.index->blocks[bli]) !=
+			    OUICHEFS_BLOCK_SIZE ||
+		    defrag_block_shared(&ds, bli))
+			break;
+	ds.dst = bli;
+	ds.next = bli;
+
+	while (bli < nb_blocks && (!max || nr_read < max)) {
+		/* Submit the reads of the next non-empty slices together */
+		nr = 0;
+		for (end = bli; end < nb_blocks && nr < OUICHEFS_READ_BATCH &&
+				(!max || nr_read + nr < max);
+		     end++) {
+			if (block_empty(ds.index->blocks[end]))
+				continue;
+			slots[nr] = end;
+			bnos[nr++] = get_block_number(ds.index->blocks[end]);
+		}
+		if (nr && ouichefs_bread_batch(sb, bnos, nr, bhs)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			int size = get_block_size(ds.index->blocks[slots[i]]);
+
+			ds.next = slots[i];
+			if (!ret)
+				ret = ouichefs_bh_wait(bhs[i]);
+			if (!ret)
+				ret = defrag_get_dst(&ds, size);
+			if (!ret) {
+				defrag_consume(&ds,
+					       bhs[i]->b_data +
+						       get_slice_start(inode,
+								       slots[i]),
+					       size);
+				bli = slots[i] + 1;
+				nr_read++;
+			}
+			brelse(bhs[i]);
+		}
+		if (ret)
+			break;
+		bli = end;
+	}
+
+	/* Write the last, partial destination block */
+	step->cursor = ds.dst;
+	if (ds.fill)
+		defrag_flush(&ds);
+	defrag_put_dst(&ds);
+
+	/* The slices consumed but not rewritten hold no data anymore */
+	for (i = ds.dst; i < bli; i++) {
+		set_block_size(&ds.index->blocks[i], 0);
+		set_slice_start(inode, i, 0);
+	}
+
+	step->blocks_read += nr_read;
+	step->blocks_written += ds.nr_written;
+
+	if (ret || bli < nb_blocks)
+		goto put_index;
+
+	/* De-allocate the blocks that are left after the packed data */
+	if (ds.dst < nb_blocks)
+		blocks_freed = ouichefs_put_slices(inode, ds.index, ds.dst,
+						   nb_blocks - 1, false);
+	/* All the slices start at 0 once packed */
+	ouichefs_starts_release(inode);
+	step->cursor = ds.dst;
+	step->blocks_freed += blocks_freed;
+	step->done = 1;
+
+	/* Update inode information */
+	OUICHEFS_INODE(inode)->nr_slices = ds.dst;
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+
+put_index:
+	step->nb_blocks = inode->i_blocks - 1;
+	ouichefs_index_mark_dirty(inode);
+	ouichefs_index_put(inode, true);
+	kfree(ds.sorted);
+free_stage:
+	kfree(ds.stage);
+
+	return ret;
+}
+
+/*
+ * Tell whether a file holds slices. Files written through the page cache have
+ * no size in their index entries and cannot be packed.
+ */
+static bool defrag_sliced(struct inode *inode)
+{
+	struct ouichefs_file_index_block *index;
+	bool sliced;
+
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index))
+		return false;
+	sliced = ouichefs_index_sliced(index, OUICHEFS_INODE(inode)->nr_slices);
+	ouichefs_index_put(inode, false);
+
+	return sliced;
+}
+
+/*
+ * Pack the data of a file at the start of its blocks and free the blocks left
+ * empty. If a block cannot be read, the slices consumed so far are packed and
+ * the others are left as they are. Files written through the page cache are
+ * refused with -EOPNOTSUPP. The inode must be locked.
+ */
+int ouichefs_defrag_inode(struct inode *inode)
+{
+	struct defrag_step step = { 0 };
+
+	if (OUICHEFS_INODE(inode)->nr_slices && !defrag_sliced(inode))
+		return -EOPNOTSUPP;
+
+	return defrag_chunk(inode, &step, 0);
+}
+
+/*
+ * Defragment a file within a budget of blocks read and of time, starting at
+ * step->cursor. The work is done OUICHEFS_READ_BATCH blocks at a time, and the
+ * inode and its index are released between two chunks so that readers and
+ * writers of the file are not held for long. A chunk reads at least two
+ * blocks, as the partial block at the cursor is read again. The inode must
+ * not be locked.
+ */
+int ouichefs_defrag_step(struct inode *inode, struct defrag_step *step)
+{
+	u64 deadline = 0;
+	int chunk, ret;
+
+	if (step->cursor < 0 || step->budget_blocks < 0 || step->budget_us < 0)
+		return -EINVAL;
+	if (step->budget_us)
+		deadline = ktime_get_ns() +
+			   (u64)step->budget_us * NSEC_PER_USEC;
+
+	step->blocks_read = 0;
+	step->blocks_written = 0;
+	step->blocks_freed = 0;
+	step->done = 0;
+
+	for (;;) {
+		chunk = OUICHEFS_READ_BATCH;
+		if (step->budget_blocks)
+			chunk = min(chunk,
+				    step->budget_blocks - step->blocks_read);
+		inode_lock(inode);
+		ret = defrag_chunk(inode, step, max(chunk, 2));
+		inode_unlock(inode);
+		if (ret || step->done)
+			return ret;
+
+		if (step->budget_blocks &&
+		    step->blocks_read >= step->budget_blocks)
+			return 0;
+		if (deadline && ktime_get_ns() >= deadline)
+			return 0;
+		if (fatal_signal_pending(current))
+			return 0;
+		cond_resched();
 	}
 }
 
 int ouichefs_defrag(struct file *file)
 {
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	return ouichefs_defrag_inode(file->f_inode);
+}
+
+/*
+ * Return true if the data blocks of a file follow each other on disk, or if
+ * the file has holes, which cannot be relocated.
+ */
+static bool defrag_contiguous(struct ouichefs_file_index_block *index,
+			      int nb_blocks)
+{
+	uint32_t first = get_block_number(index->blocks[0]);
+	int bli;
+
+	for (bli = 0; bli < nb_blocks; bli++)
+		if (!index->blocks[bli])
+			return true;
+	for (bli = 1; bli < nb_blocks; bli++)
+		if (get_block_number(index->blocks[bli]) != first + bli)
+			return false;
+	return true;
+}
+
+/*
+ * Copy the data blocks of a file to the nb_blocks blocks starting at bno.
+ */
+static int defrag_copy_blocks(struct inode *inode,
+			      struct ouichefs_file_index_block *index,
+			      int nb_blocks, uint32_t bno)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bhs[OUICHEFS_READ_BATCH], *bh;
+	uint32_t bnos[OUICHEFS_READ_BATCH];
+	int bli, nr, i, ret = 0;
+
+	for (bli = 0; bli < nb_blocks && !ret; bli += nr) {
+		nr = min(nb_blocks - bli, OUICHEFS_READ_BATCH);
+		for (i = 0; i < nr; i++)
+			bnos[i] = get_block_number(index->blocks[bli + i]);
+		if (ouichefs_bread_batch(sb, bnos, nr, bhs))
+			return -ENOMEM;
+
+		for (i = 0; i < nr; i++) {
+			if (!ret)
+				ret = ouichefs_bh_wait(bhs[i]);
+			if (!ret) {
+				bh = ouichefs_getblk_new(sb, bno + bli + i);
+				if (bh) {
+					memcpy(bh->b_data, bhs[i]->b_data,
+					       OUICHEFS_BLOCK_SIZE);
+					mark_buffer_dirty_inode(bh, inode);
+					brelse(bh);
+				} else {
+					ret = -ENOMEM;
+				}
+			}
+			brelse(bhs[i]);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Pack a file, then move its data blocks into a single free extent so that
+ * it can be read sequentially. Nothing is moved if the blocks already follow
+ * each other or if no free extent is large enough. The inode must be locked.
+ * Return 1 if the blocks were moved, 0 if not, or an error.
+ */
+int ouichefs_defrag_relocate(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index = NULL;
-	int bli = 0, data_moved = 0, logical_pos = 0, block_removed = 0,
-	    ret = 0;
+	uint32_t bno, len, old;
+	int nb_blocks, bli, ret;
+
+	/* Only sliced files can be packed, the others are moved as they are */
+	ret = ouichefs_defrag_inode(inode);
+	if (ret && ret != -EOPNOTSUPP)
+		return ret;
+
+	/*
+	 * Cached pages of files written through the page cache are mapped to
+	 * the old blocks, write them back and drop them. The invalidate lock
+	 * keeps page faults and readahead from mapping them again before the
+	 * index is switched.
+	 */
+	filemap_invalidate_lock(inode->i_mapping);
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		goto unlock;
+	ret = invalidate_inode_pages2(inode->i_mapping);
+	if (ret)
+		goto unlock;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index) {
-		ret = -EIO;
-		goto defrag_end;
+	index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+		goto unlock;
+	}
+
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
+	if (nb_blocks <= 1 || defrag_contiguous(index, nb_blocks))
+		goto put_index;
+
+	len = get_free_blocks(sbi, nb_blocks, 0, &bno);
+	if (len && len < nb_blocks) {
+		put_blocks(sbi, bno, len);
+		/* A goal in use makes the search pick the best fitting extent */
+		len = get_free_blocks(sbi, nb_blocks,
+				      OUICHEFS_INODE(inode)->index_block, &bno);
+	}
+	if (len < nb_blocks) {
+		if (len)
+			put_blocks(sbi, bno, len);
+		goto put_index;
 	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/*
-	 * First pass: copy data between blocks to fill the padding
-	 * going left to right.
+	 * The page cache reads the new blocks from the device once the index
+	 * is switched, not from the buffers, write them first.
 	 */
+	ret = defrag_copy_blocks(inode, index, nb_blocks, bno);
+	if (!ret)
+		ret = sync_mapping_buffers(inode->i_mapping);
+	if (ret) {
+		forget_blocks(inode->i_sb, bno, nb_blocks);
+		goto put_index;
+	}
 
-	data_moved = get_block_size(index->blocks[bli]);
-	logical_pos = data_moved;
+	/* Switch the index to the new blocks and free the old ones */
+	for (bli = 0; bli < nb_blocks; bli++) {
+		old = get_block_number(index->blocks[bli]);
+		set_block_number(&index->blocks[bli], bno + bli);
+		forget_block(inode->i_sb, old);
+	}
+	OUICHEFS_INODE(inode)->alloc_hint = bno + nb_blocks;
+	ouichefs_index_mark_dirty(inode);
+	ret = 1;
 
-	while (data_moved < inode->i_size && bli < inode->i_blocks - 2) {
-		int block_moved;
+put_index:
+	ouichefs_index_put(inode, true);
+unlock:
+	filemap_invalidate_unlock(inode->i_mapping);
 
-		/* Bubble up empty blocks at the end of the index array */
-		if (block_empty(index->blocks[bli + 1])) {
-			bubble_up_block(index, bli + 1, inode->i_blocks - 1);
+	return ret;
+}
+
+/*
+ * Background defragmentation
+ *
+ * Writes that leave slack in a file queue it on the defrag_list of its
+ * superblock. The queue is processed by a per-superblock worker once no write
+ * was queued for idle_ms milliseconds, and at most rate files are compacted
+ * per second. A file is compacted only if it wastes at least min_waste bytes
+ * or has at least min_partial partially filled blocks. The knobs are shared by
+ * all volumes and live in /sys/kernel/ouichefs/defrag.
+ */
+
+struct ouichefs_defrag_params ouichefs_defrag_params = {
+	.enabled = 1,
+	.min_waste = 4 * OUICHEFS_BLOCK_SIZE,
+	.min_partial = 8,
+	.idle_ms = 1000,
+	.rate = 16,
+};
+
+/* Bytes allocated to a file but not holding data */
+static uint32_t waste_of(uint32_t blocks, uint32_t size)
+{
+	uint32_t allocated = (blocks - 1) * OUICHEFS_BLOCK_SIZE;
+
+	if (blocks <= 1 || allocated <= size)
+		return 0;
+	return allocated - size;
+}
+
+static uint32_t defrag_waste(struct inode *inode)
+{
+	return waste_of(inode->i_blocks, inode->i_size);
+}
+
+/*
+ * Tell whether a file is fragmented enough to be compacted.
+ * The inode must be locked.
+ */
+static bool defrag_needed(struct inode *inode)
+{
+	struct ouichefs_defrag_params *p = &ouichefs_defrag_params;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	uint32_t waste = defrag_waste(inode), partial = 0;
+	int bli;
+
+	if (!waste)
+		return false;
+
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index))
+		return false;
+	if (!ouichefs_index_sliced(index, ci->nr_slices)) {
+		ouichefs_index_put(inode, false);
+		return false;
+	}
+	if (waste >= READ_ONCE(p->min_waste)) {
+		ouichefs_index_put(inode, false);
+		return true;
+	}
+	/* The last block of a file is allowed to be partial */
+	for (bli = 0; bli < ci->nr_slices - 1; bli++)
+		if (get_block_size(index->blocks[bli]) < OUICHEFS_BLOCK_SIZE)
+			partial++;
+	ouichefs_index_put(inode, false);
+
+	return partial >= READ_ONCE(p->min_partial);
+}
+
+/*
+ * Queue a file that was just written for background compaction, and push
+ * the worker back so that it only runs once writes settle. Files written
+ * through the page cache are never queued.
+ */
+void ouichefs_defrag_note(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_defrag_params *p = &ouichefs_defrag_params;
+
+	if (!READ_ONCE(p->enabled) || !defrag_waste(inode) ||
+	    !defrag_sliced(inode))
+		return;
+
+	spin_lock(&sbi->defrag_lock);
+	if (list_empty(&ci->defrag_list))
+		list_add_tail(&ci->defrag_list, &sbi->defrag_list);
+	if (!sbi->defrag_stop)
+		mod_delayed_work(sbi->defrag_wq, &sbi->defrag_work,
+				 msecs_to_jiffies(READ_ONCE(p->idle_ms)));
+	spin_unlock(&sbi->defrag_lock);
+}
+
+/*
+ * Remove an inode from the queue before it is freed.
+ */
+void ouichefs_defrag_forget(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock(&sbi->defrag_lock);
+	list_del_init(&ci->defrag_list);
+	spin_unlock(&sbi->defrag_lock);
+}
+
+/*
+ * Take the first queued inode with a reference, or return NULL. Inodes being
+ * evicted are skipped, they remove themselves from the queue.
+ */
+static struct inode *defrag_next(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_inode_info *ci, *tmp;
+	struct inode *inode = NULL;
+
+	spin_lock(&sbi->defrag_lock);
+	list_for_each_entry_safe(ci, tmp, &sbi->defrag_list, defrag_list) {
+		inode = igrab(&ci->vfs_inode);
+		if (inode) {
+			list_del_init(&ci->defrag_list);
+			break;
+		}
+	}
+	spin_unlock(&sbi->defrag_lock);
+
+	return inode;
+}
+
+static void defrag_worker(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(
+		to_delayed_work(work), struct ouichefs_sb_info, defrag_work);
+	struct ouichefs_defrag_params *p = &ouichefs_defrag_params;
+	struct super_block *sb = sbi->sb;
+	unsigned int budget = READ_ONCE(p->rate);
+	struct ouichefs_inode_info *ci;
+	struct inode *inode;
+	LIST_HEAD(busy);
+
+	if (!READ_ONCE(p->enabled) || sb_rdonly(sb))
+		return;
+	if (!sb_start_write_trylock(sb))
+		goto requeue;
+
+	while (budget && !READ_ONCE(sbi->defrag_stop)) {
+		inode = defrag_next(sbi);
+		if (!inode)
+			break;
+
+		/* Leave files being written alone, they are retried later */
+		if (!inode_trylock(inode)) {
+			ci = OUICHEFS_INODE(inode);
+			spin_lock(&sbi->defrag_lock);
+			if (list_empty(&ci->defrag_list))
+				list_add_tail(&ci->defrag_list, &busy);
+			spin_unlock(&sbi->defrag_lock);
+			iput(inode);
 			continue;
 		}
 
-		/* Move data in the next block to the current block. */
-		block_moved = move_shift_block_content_to(
-			index, inode->i_sb, bli + 1, bli, logical_pos);
-		if (block_moved < 0) {
-			ret = -EIO;
-			goto free_bh_index;
+		if (defrag_needed(inode)) {
+			if (ouichefs_defrag_inode(inode))
+				pr_warn("failed to defrag inode %lu\n",
+					inode->i_ino);
+			budget--;
 		}
-		data_moved += block_moved;
-		logical_pos += block_moved;
-
-		/* If the block is full, go to the block afterward. */
-		if (logical_pos == OUICHEFS_BLOCK_SIZE) {
-			bli++;
-			logical_pos = get_block_size(index->blocks[bli]);
-			data_moved += logical_pos;
+		inode_unlock(inode);
+		iput(inode);
+	}
+
+	spin_lock(&sbi->defrag_lock);
+	list_splice_tail(&busy, &sbi->defrag_list);
+	spin_unlock(&sbi->defrag_lock);
+
+	sb_end_write(sb);
+
+requeue:
+	/* Rate limit: the rest of the queue waits for the next second */
+	spin_lock(&sbi->defrag_lock);
+	if (!list_empty(&sbi->defrag_list) && !sbi->defrag_stop)
+		queue_delayed_work(sbi->defrag_wq, &sbi->defrag_work, HZ);
+	spin_unlock(&sbi->defrag_lock);
+}
+
+int ouichefs_defrag_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	INIT_LIST_HEAD(&sbi->defrag_list);
+	spin_lock_init(&sbi->defrag_lock);
+	INIT_DELAYED_WORK(&sbi->defrag_work, defrag_worker);
+	sbi->defrag_stop = false;
+
+	sbi->defrag_wq = alloc_workqueue("ouichefs-defrag/%s",
+					 WQ_UNBOUND | WQ_FREEZABLE, 1, sb->s_id);
+	if (!sbi->defrag_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Stop the worker before the inodes of the volume are evicted. It must not
+ * hold an inode reference past this point.
+ */
+void ouichefs_defrag_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	spin_lock(&sbi->defrag_lock);
+	sbi->defrag_stop = true;
+	spin_unlock(&sbi->defrag_lock);
+	cancel_delayed_work_sync(&sbi->defrag_work);
+}
+
+void ouichefs_defrag_free(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	ouichefs_defrag_stop(sb);
+	destroy_workqueue(sbi->defrag_wq);
+}
+
+/*
+ * Volume defragmentation
+ *
+ * The inode store is scanned for regular files, which are ranked by wasted
+ * bytes. The worst ones are then defragmented in parallel, one work item per
+ * file on an unbound workqueue.
+ */
+
+struct defrag_candidate {
+	uint32_t ino;
+	uint32_t waste;
+};
+
+struct defrag_totals {
+	atomic64_t wasted_saved; /* Bytes no longer wasted */
+	atomic_t blocks_freed;
+	atomic_t nr_defragged;
+	atomic_t nr_relocated;
+};
+
+struct defrag_job {
+	struct work_struct work;
+	struct super_block *sb;
+	uint32_t ino;
+	bool relocate; /* Also move the file into a single extent */
+	struct defrag_totals *totals;
+};
+
+static int defrag_candidate_cmp(const void *a, const void *b)
+{
+	const struct defrag_candidate *ca = a, *cb = b;
+
+	if (ca->waste != cb->waste)
+		return ca->waste < cb->waste ? 1 : -1;
+	return 0;
+}
+
+struct defrag_scan_ctx {
+	struct defrag_candidate *cands;
+	uint32_t nr_cands;
+	struct volume_defrag_info *info;
+};
+
+/*
+ * Add a regular file to the candidates if it wastes space, and count it in
+ * info. The in-memory inode is used when it is cached, as the inode store may
+ * not be up to date.
+ */
+static int defrag_scan_inode(struct super_block *sb, uint32_t ino,
+			     struct ouichefs_inode *disk_inode, void *data)
+{
+	struct defrag_scan_ctx *scan = data;
+	struct volume_defrag_info *info = scan->info;
+	struct inode *inode;
+	uint32_t mode, nlink, blocks, size, waste;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		mode = inode->i_mode;
+		nlink = inode->i_nlink;
+		blocks = inode->i_blocks;
+		size = inode->i_size;
+		iput(inode);
+	} else {
+		mode = le32_to_cpu(disk_inode->i_mode);
+		nlink = le32_to_cpu(disk_inode->i_nlink);
+		blocks = le32_to_cpu(disk_inode->i_blocks);
+		size = le32_to_cpu(disk_inode->i_size);
+	}
+	if (!S_ISREG(mode) || !nlink)
+		return 0;
+
+	waste = waste_of(blocks, size);
+	info->nr_files++;
+	info->wasted_before += waste;
+	info->blocks_before += blocks > 1 ? blocks - 1 : 0;
+	if (waste) {
+		scan->cands[scan->nr_cands].ino = ino;
+		scan->cands[scan->nr_cands].waste = waste;
+		scan->nr_cands++;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill cands with the regular files that waste space, and count all the
+ * regular files in info.
+ */
+static int defrag_scan(struct super_block *sb, struct defrag_candidate *cands,
+		       uint32_t *nr_cands, struct volume_defrag_info *info)
+{
+	struct defrag_scan_ctx scan = { .cands = cands, .info = info };
+	int ret;
+
+	ret = ouichefs_for_each_inode(sb, defrag_scan_inode, &scan);
+	*nr_cands = scan.nr_cands;
+
+	return ret;
+}
+
+static void defrag_job_run(struct work_struct *work)
+{
+	struct defrag_job *job = container_of(work, struct defrag_job, work);
+	struct inode *inode;
+	uint32_t waste, blocks;
+	int ret;
+
+	inode = ouichefs_iget(job->sb, job->ino);
+	if (IS_ERR(inode))
+		return;
+
+	inode_lock(inode);
+	/* The file may have been removed since the scan */
+	if (S_ISREG(inode->i_mode) && inode->i_nlink &&
+	    inode_in_use(OUICHEFS_SB(job->sb), job->ino)) {
+		waste = defrag_waste(inode);
+		blocks = inode->i_blocks;
+		if (job->relocate)
+			ret = ouichefs_defrag_relocate(inode);
+		else
+			ret = ouichefs_defrag_inode(inode);
+		if (ret > 0)
+			atomic_inc(&job->totals->nr_relocated);
+		if (waste && ret >= 0) {
+			atomic64_add(waste - defrag_waste(inode),
+				     &job->totals->wasted_saved);
+			atomic_add(blocks - inode->i_blocks,
+				   &job->totals->blocks_freed);
+			atomic_inc(&job->totals->nr_defragged);
 		}
 	}
+	inode_unlock(inode);
+	iput(inode);
+}
 
-	/*
-	 * Second pass: de-allocate all empty blocks that we bubbled at the end.
-	 */
+/*
+ * Defragment the info->max_files regular files of a volume that waste the
+ * most space, or all of them if max_files is 0, and report the space wasted
+ * by all the files before and after. With info->relocate, each of them is
+ * also moved into a single extent.
+ */
+int ouichefs_defrag_volume(struct super_block *sb,
+			   struct volume_defrag_info *info)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct defrag_totals totals = { 0 };
+	struct defrag_candidate *cands;
+	struct workqueue_struct *wq;
+	struct defrag_job *jobs;
+	uint32_t nr_cands = 0, nr, i;
+	int ret;
+
+	if (info->max_files < 0)
+		return -EINVAL;
+
+	info->nr_files = 0;
+	info->nr_defragged = 0;
+	info->nr_relocated = 0;
+	info->wasted_before = 0;
+	info->blocks_before = 0;
 
-	if (!block_empty(index->blocks[bli]))
-		bli++;
+	cands = kvmalloc_array(sbi->nr_inodes, sizeof(*cands), GFP_KERNEL);
+	if (!cands)
+		return -ENOMEM;
 
-	for (; bli < inode->i_blocks - 1; bli++) {
-		put_block(OUICHEFS_SB(inode->i_sb),
-			  get_block_number(index->blocks[bli]));
-		index->blocks[bli] = 0;
-		block_removed++;
+	ret = defrag_scan(sb, cands, &nr_cands, info);
+	if (ret)
+		goto free_cands;
+	info->nr_fragmented = nr_cands;
+
+	/* Worst files first */
+	sort(cands, nr_cands, sizeof(*cands), defrag_candidate_cmp, NULL);
+	nr = nr_cands;
+	if (info->max_files)
+		nr = min_t(uint32_t, nr, info->max_files);
+
+	jobs = kvmalloc_array(nr, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs && nr) {
+		ret = -ENOMEM;
+		goto free_cands;
 	}
 
-	/* Update inode information */
-	inode->i_blocks -= block_removed;
-	inode->i_mtime = inode->i_ctime = current_time(inode);
-	mark_inode_dirty(inode);
+	/* Unbound, so that the files are spread over all the CPUs */
+	wq = alloc_workqueue("ouichefs-vdefrag/%s", WQ_UNBOUND, 0, sb->s_id);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto free_jobs;
+	}
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&jobs[i].work, defrag_job_run);
+		jobs[i].sb = sb;
+		jobs[i].ino = cands[i].ino;
+		jobs[i].relocate = info->relocate;
+		jobs[i].totals = &totals;
+		queue_work(wq, &jobs[i].work);
+	}
+	/* Wait for all the jobs */
+	destroy_workqueue(wq);
+
+	info->nr_defragged = atomic_read(&totals.nr_defragged);
+	info->nr_relocated = atomic_read(&totals.nr_relocated);
+	info->wasted_after =
+		info->wasted_before - atomic64_read(&totals.wasted_saved);
+	info->blocks_after =
+		info->blocks_before - atomic_read(&totals.blocks_freed);
 
-free_bh_index:
-	mark_buffer_dirty(bh_index);
-	sync_dirty_buffer(bh_index);
-	brelse(bh_index);
+free_jobs:
+	kvfree(jobs);
+free_cands:
+	kvfree(cands);
 
-defrag_end:
 	return ret;
 }
@@ -12,6 +12,9 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
@@ -20,26 +23,28 @@
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
  * true, allocate a new block on disk and map it.
+ * Up to b_size bytes are mapped at once: following blocks are allocated in the
+ * same run, or mapped too if they are physically contiguous.
  */
 static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 				   struct buffer_head *bh_result, int create)
 {
 	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
+	uint32_t max_blocks = bh_result->b_size >> inode->i_blkbits;
+	uint32_t bno, len = 1, i;
+	int ret = 0;
 
 	/* If block number exceeds filesize, fail */
 	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
 		return -EFBIG;
+	max_blocks = clamp_t(uint32_t, max_blocks, 1,
+			     (OUICHEFS_BLOCK_SIZE >> 2) - iblock);
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	/* Get the cached index block */
+	index = ouichefs_index_get(inode, create);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
 
 	/*
 	 * Check if iblock is already allocated. If not and create is true,
@@ -48,34 +53,103 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	if (index->blocks[iblock] == 0) {
 		if (!create) {
 			ret = 0;
-			goto brelse_index;
+			goto put_index;
 		}
-		bno = get_free_block(sbi);
-		if (!bno) {
+		/* Allocate the unallocated blocks asked for in one run */
+		while (len < max_blocks && index->blocks[iblock + len] == 0)
+			len++;
+		len = ouichefs_rsv_alloc(inode, len,
+					 get_alloc_goal(inode, index, iblock),
+					 &bno);
+		if (!len) {
 			ret = -ENOSPC;
-			goto brelse_index;
+			goto put_index;
 		}
-		set_block_number(&index->blocks[iblock], bno);
+		OUICHEFS_INODE(inode)->alloc_hint = bno + len;
+		for (i = 0; i < len; i++)
+			set_block_number(&index->blocks[iblock + i], bno + i);
+		ouichefs_index_mark_dirty(inode);
 	} else {
+		/* Map the physically contiguous blocks that follow at once */
 		bno = get_block_number(index->blocks[iblock]);
+		while (len < max_blocks &&
+		       get_block_number(index->blocks[iblock + len]) ==
+			       bno + len &&
+		       index->blocks[iblock + len] != 0)
+			len++;
 	}
 
-	/* Map the physical block to the given buffer_head */
+	/* Map the physical blocks to the given buffer_head */
 	map_bh(bh_result, sb, bno);
+	bh_result->b_size = len << inode->i_blkbits;
 
-brelse_index:
-	brelse(bh_index);
+put_index:
+	ouichefs_index_put(inode, create);
 
 	return ret;
 }
 
 /*
- * Find the logical block number and the logical position inside this block
- * based on a list of block with their sizes.
- * Return 1 if nothing was found, otherwise 0.
+ * Forget the cached offsets from block_index onward. They are recomputed from
+ * the index block the next time find_block_pos() needs them.
+ */
+void ouichefs_offsets_invalidate(struct inode *inode, int block_index)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (block_index < ci->nr_offsets)
+		ci->nr_offsets = max(block_index, 0);
+}
+
+/*
+ * Bring the first nb_blocks cached offsets up to date, starting after the last
+ * valid one. Readers holding index_sem for read may extend the cache together:
+ * the entries are filled under offsets_lock, and published by the release of
+ * nr_offsets that lookups acquire.
+ * Return -ENOMEM if the cache could not be allocated.
+ */
+static int ouichefs_offsets_update(struct ouichefs_inode_info *ci,
+				   struct ouichefs_file_index_block *index,
+				   int nb_blocks)
+{
+	uint32_t offset, *offsets;
+	int bli;
+
+	if (smp_load_acquire(&ci->nr_offsets) >= nb_blocks)
+		return 0;
+
+	if (!ci->offsets) {
+		offsets = kmalloc_array(OUICHEFS_BLOCK_SIZE >> 2,
+					sizeof(uint32_t), GFP_KERNEL);
+		if (!offsets)
+			return -ENOMEM;
+		/* Concurrent readers may race to allocate the cache */
+		if (cmpxchg(&ci->offsets, NULL, offsets))
+			kfree(offsets);
+	}
+
+	spin_lock(&ci->offsets_lock);
+	bli = ci->nr_offsets;
+	offset = bli ? ci->offsets[bli - 1] : 0;
+	for (; bli < nb_blocks; bli++) {
+		offset += get_block_size(index->blocks[bli]);
+		ci->offsets[bli] = offset;
+	}
+	if (nb_blocks > ci->nr_offsets)
+		smp_store_release(&ci->nr_offsets, nb_blocks);
+	spin_unlock(&ci->offsets_lock);
+
+	return 0;
+}
+
+/*
+ * Walk the list of blocks with their sizes. Only used when the offset cache
+ * could not be allocated.
  */
-int find_block_pos(loff_t pos, struct ouichefs_file_index_block *index,
-		   int nb_blocks, int *logical_block_index, int *logical_pos)
+static int find_block_pos_slow(loff_t pos,
+			       struct ouichefs_file_index_block *index,
+			       int nb_blocks, int *logical_block_index,
+			       int *logical_pos)
 {
 	int current_block = 0, block_size;
 	int remaining_size = pos;
@@ -99,18 +173,201 @@ int find_block_pos(loff_t pos, struct ouichefs_file_index_block *index,
 	return 0;
 }
 
-static int ouichefs_read_folio(struct file *file, struct folio *folio)
+/*
+ * Find the logical block number and the logical position inside this block
+ * based on a list of block with their sizes. The cumulative block offsets are
+ * cached in the inode, so the lookup is a binary search.
+ * Return 1 if nothing was found, otherwise 0.
+ */
+int find_block_pos(struct inode *inode, loff_t pos,
+		   struct ouichefs_file_index_block *index, int nb_blocks,
+		   int *logical_block_index, int *logical_pos)
 {
-	return mpage_read_folio(folio, ouichefs_file_get_block);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int low = 0, high = nb_blocks, mid;
+
+	if (pos == 0) {
+		*logical_block_index = 0;
+		*logical_pos = 0;
+		return 0;
+	}
+
+	if (ouichefs_offsets_update(ci, index, nb_blocks))
+		return find_block_pos_slow(pos, index, nb_blocks,
+					   logical_block_index, logical_pos);
+
+	/* First block whose end offset reaches the cursor position */
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (ci->offsets[mid] < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low == nb_blocks)
+		return 1;
+
+	*logical_block_index = low;
+	*logical_pos = pos - (low ? ci->offsets[low - 1] : 0);
+
+	return 0;
+}
+
+/*
+ * Fill a folio of a sliced file. The folio holds the logical bytes
+ * [folio_pos, folio_pos + folio_size), gathered from as many slices as needed.
+ * The folio is unlocked on return.
+ */
+static int ouichefs_sliced_fill_folio(struct inode *inode,
+				      struct ouichefs_file_index_block *index,
+				      struct folio *folio)
+{
+	struct buffer_head *bhs[OUICHEFS_READ_BATCH];
+	uint32_t bnos[OUICHEFS_READ_BATCH];
+	loff_t pos = folio_pos(folio), isize = i_size_read(inode);
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, bli = 0,
+	    logical_pos = 0, nr, i;
+	size_t to_fill = 0, filled = 0, len;
+	int ret = 0;
+	long wanted;
+	char *kaddr;
+
+	if (pos < isize)
+		to_fill = min_t(loff_t, folio_size(folio), isize - pos);
+	if (to_fill &&
+	    find_block_pos(inode, pos, index, nb_blocks, &bli, &logical_pos))
+		to_fill = 0;
+
+	kaddr = kmap_local_folio(folio, 0);
+	while (filled < to_fill && bli < nb_blocks) {
+		/* Submit the reads of the slices holding the rest of the folio */
+		wanted = logical_pos + to_fill - filled;
+		for (nr = 0; nr < OUICHEFS_READ_BATCH && wanted > 0 &&
+			     bli + nr < nb_blocks;
+		     nr++) {
+			bnos[nr] = get_block_number(index->blocks[bli + nr]);
+			wanted -= get_block_size(index->blocks[bli + nr]);
+		}
+		ret = ouichefs_bread_batch(inode->i_sb, bnos, nr, bhs);
+		if (ret)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			if (!ret)
+				ret = ouichefs_bh_wait(bhs[i]);
+			if (!ret) {
+				len = get_block_size(index->blocks[bli]) -
+				      logical_pos;
+				len = min(len, to_fill - filled);
+				memcpy(kaddr + filled,
+				       bhs[i]->b_data +
+					       get_slice_start(inode, bli) +
+					       logical_pos,
+				       len);
+				filled += len;
+				bli++;
+				logical_pos = 0;
+			}
+			brelse(bhs[i]);
+		}
+		if (ret)
+			break;
+	}
+	kunmap_local(kaddr);
+
+	if (ret) {
+		folio_set_error(folio);
+		folio_unlock(folio);
+		return ret;
+	}
+
+	folio_zero_segment(folio, filled, folio_size(folio));
+	folio_mark_uptodate(folio);
+	folio_unlock(folio);
+
+	return 0;
+}
+
+/*
+ * Start reading the slices holding the logical bytes [pos, pos + len) of a
+ * sliced file. The reads are submitted together and are not waited for.
+ */
+static void ouichefs_sliced_readahead_blocks(struct inode *inode,
+					     struct ouichefs_file_index_block *index,
+					     loff_t pos, size_t len)
+{
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, bli, logical_pos;
+	struct blk_plug plug;
+	long wanted;
+
+	if (pos >= i_size_read(inode) ||
+	    find_block_pos(inode, pos, index, nb_blocks, &bli, &logical_pos))
+		return;
+
+	wanted = logical_pos + len;
+	blk_start_plug(&plug);
+	for (; bli < nb_blocks && wanted > 0; bli++) {
+		sb_breadahead(inode->i_sb,
+			      get_block_number(index->blocks[bli]));
+		wanted -= get_block_size(index->blocks[bli]);
+	}
+	blk_finish_plug(&plug);
 }
 
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	struct ouichefs_file_index_block *index;
+	int ret;
+
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index)) {
+		folio_unlock(folio);
+		return PTR_ERR(index);
+	}
+
+	if (ouichefs_index_sliced(index, OUICHEFS_INODE(inode)->nr_slices)) {
+		ret = ouichefs_sliced_fill_folio(inode, index, folio);
+		ouichefs_index_put(inode, false);
+		return ret;
+	}
+
+	/* The page cache gets the index again to map each block */
+	ouichefs_index_put(inode, false);
+	return mpage_read_folio(folio, ouichefs_file_get_block);
+}
+
+/*
+ * Called by the page cache to read several pages ahead of their use. For a
+ * sliced file, the reads of all the slices in the range are submitted first,
+ * then each folio is filled.
+ */
 static void ouichefs_readahead(struct readahead_control *rac)
 {
-	mpage_readahead(rac, ouichefs_file_get_block);
+	struct inode *inode = rac->mapping->host;
+	struct ouichefs_file_index_block *index;
+	struct folio *folio;
+
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index))
+		return;
+
+	if (!ouichefs_index_sliced(index, OUICHEFS_INODE(inode)->nr_slices)) {
+		ouichefs_index_put(inode, false);
+		mpage_readahead(rac, ouichefs_file_get_block);
+		return;
+	}
+
+	ouichefs_sliced_readahead_blocks(inode, index, readahead_pos(rac),
+					 readahead_length(rac));
+	while ((folio = readahead_folio(rac)))
+		ouichefs_sliced_fill_folio(inode, index, folio);
+
+	ouichefs_index_put(inode, false);
 }
 
 /*
@@ -133,6 +390,7 @@ static int ouichefs_write_begin(struct file *file,
 				void **fsdata)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
 	int err;
 	uint32_t nr_allocs = 0;
 
@@ -140,11 +398,12 @@ static int ouichefs_write_begin(struct file *file,
 	if (pos + len > OUICHEFS_MAX_FILESIZE)
 		return -ENOSPC;
 	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
+	if (nr_allocs > ci->nr_slices)
+		nr_allocs -= ci->nr_slices;
 	else
 		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
+	if (nr_allocs > percpu_counter_read_positive(&sbi->free_blocks) +
+				READ_ONCE(ci->rsv_len))
 		return -ENOSPC;
 
 	/* prepare the write */
@@ -169,7 +428,6 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 {
 	int ret;
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 
 	/* Complete the write() */
@@ -185,36 +443,36 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 		inode->i_blocks = (inode->i_size / OUICHEFS_BLOCK_SIZE) + 1;
 		if ((inode->i_size % OUICHEFS_BLOCK_SIZE) != 0)
 			inode->i_blocks++;
+		/* One entry per block of the file, holes included */
+		OUICHEFS_INODE(inode)->nr_slices = inode->i_blocks - 1;
 		inode->i_mtime = inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
 
 		/* If file is smaller than before, free unused blocks */
 		if (nr_blocks_old > inode->i_blocks) {
 			int i;
-			struct buffer_head *bh_index;
 			struct ouichefs_file_index_block *index;
 
 			/* Free unused blocks from page cache */
 			truncate_pagecache(inode, inode->i_size);
 
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
+			/* Get index block to remove unused blocks */
+			index = ouichefs_index_get(inode, true);
+			if (IS_ERR(index)) {
 				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
 				       file->f_path.dentry->d_name.name,
 				       nr_blocks_old - inode->i_blocks);
 				goto end;
 			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
 
 			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
 			     i++) {
 				put_block(OUICHEFS_SB(sb), index->blocks[i]);
 				index->blocks[i] = 0;
 			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
+			ouichefs_offsets_invalidate(inode, inode->i_blocks - 1);
+			ouichefs_index_mark_dirty(inode);
+			ouichefs_index_put(inode, true);
 		}
 	}
 end:
@@ -236,39 +494,93 @@ static int ouichefs_open(struct inode *inode, struct file *file)
 	bool trunc = (file->f_flags & O_TRUNC) != 0;
 
 	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
-
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
-			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, get_block_number(index->blocks[iblock]));
-			index->blocks[iblock] = 0;
-		}
+
+		/* Get the cached index block */
+		index = ouichefs_index_get(inode, true);
+		if (IS_ERR(index))
+			return PTR_ERR(index);
+
+		if (ci->nr_slices)
+			ouichefs_put_slices(inode, index, 0,
+					    ci->nr_slices - 1, false);
+		ouichefs_starts_release(inode);
 		inode->i_size = 0;
-		inode->i_blocks = 0;
+		inode->i_blocks = 1;
+		ci->nr_slices = 0;
+		ouichefs_offsets_invalidate(inode, 0);
 
-		brelse(bh_index);
+		ouichefs_index_mark_dirty(inode);
+		ouichefs_index_put(inode, true);
 	}
 
+	/*
+	 * The read and write iterators handle IOCB_NOWAIT. FMODE_BUF_WASYNC is
+	 * not set: generic_file_write_iter() sleeps on the inode lock, and the
+	 * writer in use can change while the file is open.
+	 */
+	file->f_mode |= FMODE_NOWAIT;
+
 	return 0;
 }
 
+/*
+ * The last writer of a file gives the blocks reserved for it back, so that
+ * closed files do not hold free space. The blocks preallocated by fallocate()
+ * stay reserved until the inode is evicted.
+ */
+static int ouichefs_release(struct inode *inode, struct file *file)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+
+	if (!(file->f_mode & FMODE_WRITE) ||
+	    atomic_read(&inode->i_writecount) > 1 ||
+	    !READ_ONCE(ci->rsv_len) || READ_ONCE(ci->rsv_keep))
+		return 0;
+
+	/* Only for the lock, the window is given back on eviction otherwise */
+	index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index))
+		return 0;
+	if (!ci->rsv_keep)
+		ouichefs_rsv_release(inode);
+	ouichefs_index_put(inode, true);
+
+	return 0;
+}
+
+/*
+ * Flush the data, index and inode of a file. Data and index buffers are
+ * attached to the inode, so only the blocks of this file are written. The
+ * index is only copied to its buffer on write back, do it first so that it
+ * is flushed along with the data.
+ */
+static int ouichefs_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	ret = ouichefs_index_sync(inode);
+	if (ret)
+		return ret;
+
+	return generic_file_fsync(file, start, end, datasync);
+}
+
 struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.open = ouichefs_open,
+	.release = ouichefs_release,
 	.llseek = generic_file_llseek,
 	.read = ouichefs_read,
 	.read_iter = generic_file_read_iter,
+	.splice_read = filemap_splice_read,
 	.write = ouichefs_write,
 	.write_iter = generic_file_write_iter,
 	.unlocked_ioctl = ouichefs_ioctl,
+	.fsync = ouichefs_fsync,
+	.fallocate = ouichefs_fallocate,
 };
@@ -35,6 +35,9 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/* The defrag worker holds inode references, stop it before eviction */
+	if (sb->s_root)
+		ouichefs_defrag_stop(sb);
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -59,16 +62,22 @@ static int __init ouichefs_init(void)
 		goto err;
 	}
 
+	ret = ouichefs_init_extent_cache();
+	if (ret) {
+		pr_err("extent cache creation failed\n");
+		goto err_inode;
+	}
+
 	ret = register_filesystem(&ouichefs_file_system_type);
 	if (ret) {
 		pr_err("register_filesystem() failed\n");
-		goto err_inode;
+		goto err_extent;
 	}
 
 	kobj_sysfs = kobject_create_and_add("ouichefs", kernel_kobj);
 	if (!kobj_sysfs) {
 		pr_err("kobject_create_and_add() failed\n");
-		goto err_inode;
+		goto err_extent;
 	}
 
 	ret = sysfs_create_file(kobj_sysfs, &read_fn_attr.attr);
@@ -81,12 +90,19 @@ static int __init ouichefs_init(void)
 		pr_err("sysfs_create_file() for write_fn_attr failed\n");
 		goto free_kobj;
 	}
+	ret = sysfs_create_group(kobj_sysfs, &defrag_attr_group);
+	if (ret) {
+		pr_err("sysfs_create_group() for defrag failed\n");
+		goto free_kobj;
+	}
 
 	pr_info("module loaded\n");
 	return 0;
 
 free_kobj:
 	kobject_put(kobj_sysfs);
+err_extent:
+	ouichefs_destroy_extent_cache();
 err_inode:
 	ouichefs_destroy_inode_cache();
 err:
@@ -103,6 +119,7 @@ static void __exit ouichefs_exit(void)
 	if (ret)
 		pr_err("unregister_filesystem() failed\n");
 
+	ouichefs_destroy_extent_cache();
 	ouichefs_destroy_inode_cache();
 
 	pr_info("module unloaded\n");
@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include "linux/buffer_head.h"
+#include "linux/slab.h"
+#include "linux/sort.h"
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * In-memory copy of the index block of regular files.
+ *
+ * The index block is read once and kept in ouichefs_inode_info for as long as
+ * the inode is cached. Changes are only made in memory and written back to the
+ * buffer cache by ouichefs_write_inode(). Clean copies are dropped by a
+ * shrinker under memory pressure. The start block of the file, if it has one,
+ * is cached and written back along with the index.
+ */
+
+/*
+ * Read the start block of a file into ci->starts if it has one and it is not
+ * cached yet. Called with index_sem held.
+ */
+static int ouichefs_starts_load(struct ouichefs_inode_info *ci,
+				struct super_block *sb)
+{
+	struct buffer_head *bh;
+	uint16_t *starts;
+
+	if (!ci->start_block || ci->starts)
+		return 0;
+
+	starts = kmalloc(sizeof(struct ouichefs_file_start_block), GFP_KERNEL);
+	if (!starts)
+		return -ENOMEM;
+	bh = sb_bread(sb, ci->start_block);
+	if (!bh) {
+		kfree(starts);
+		return -EIO;
+	}
+	memcpy(starts, bh->b_data, sizeof(struct ouichefs_file_start_block));
+	brelse(bh);
+
+	/* Another reader may have loaded the starts in the meantime */
+	if (cmpxchg(&ci->starts, NULL, starts))
+		kfree(starts);
+
+	return 0;
+}
+
+/*
+ * Get the index of a file, reading it from disk if it is not cached.
+ * Take index_sem for reading, or for writing if write is true. The lock is held
+ * until ouichefs_index_put() is called.
+ * Return an ERR_PTR() on failure, in which case the lock is not held.
+ */
+struct ouichefs_file_index_block *ouichefs_index_get(struct inode *inode,
+						     bool write)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	int ret;
+
+	if (write)
+		down_write(&ci->index_sem);
+	else
+		down_read(&ci->index_sem);
+
+	if (ci->index)
+		return ci->index;
+
+	/* The starts are loaded first, they are valid once the index is */
+	ret = ouichefs_starts_load(ci, inode->i_sb);
+	if (ret)
+		goto unlock;
+
+	index = kmalloc(sizeof(*index), GFP_KERNEL);
+	if (!index) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	/* Read index block from disk */
+	bh_index = sb_bread(inode->i_sb, ci->index_block);
+	if (!bh_index) {
+		kfree(index);
+		ret = -EIO;
+		goto unlock;
+	}
+	memcpy(index, bh_index->b_data, OUICHEFS_BLOCK_SIZE);
+	brelse(bh_index);
+
+	/* Another reader may have loaded the index in the meantime */
+	if (cmpxchg(&ci->index, NULL, index)) {
+		kfree(index);
+		return ci->index;
+	}
+
+	spin_lock(&sbi->index_lru_lock);
+	list_add_tail(&ci->index_lru, &sbi->index_lru);
+	sbi->nr_cached_index++;
+	spin_unlock(&sbi->index_lru_lock);
+
+	return index;
+
+unlock:
+	ouichefs_index_put(inode, write);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Same as ouichefs_index_get() but never sleeps, for IOCB_NOWAIT requests.
+ * Return ERR_PTR(-EAGAIN) if the lock is contended or if the index is not
+ * cached.
+ */
+struct ouichefs_file_index_block *ouichefs_index_tryget(struct inode *inode,
+							bool write)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (write) {
+		if (!down_write_trylock(&ci->index_sem))
+			return ERR_PTR(-EAGAIN);
+	} else {
+		if (!down_read_trylock(&ci->index_sem))
+			return ERR_PTR(-EAGAIN);
+	}
+
+	if (ci->index)
+		return ci->index;
+
+	ouichefs_index_put(inode, write);
+	return ERR_PTR(-EAGAIN);
+}
+
+/*
+ * Release the lock taken by ouichefs_index_get().
+ */
+void ouichefs_index_put(struct inode *inode, bool write)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (write)
+		up_write(&ci->index_sem);
+	else
+		up_read(&ci->index_sem);
+}
+
+/*
+ * Mark the cached index as modified. It is written back with the inode.
+ * index_sem must be held for writing.
+ */
+void ouichefs_index_mark_dirty(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (ci->index_dirty)
+		return;
+
+	ci->index_dirty = true;
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Copy a dirty cached index to its buffer and mark the buffer dirty.
+ * The buffer is then written back by the flusher thread or by fsync().
+ */
+int ouichefs_index_sync(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index;
+	int ret = 0;
+
+	down_read(&ci->index_sem);
+
+	if (!ci->index || !ci->index_dirty)
+		goto unlock;
+
+	/* The whole block is overwritten, there is nothing to read */
+	bh_index = ouichefs_getblk_new(inode->i_sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	lock_buffer(bh_index);
+	memcpy(bh_index->b_data, ci->index, OUICHEFS_BLOCK_SIZE);
+	unlock_buffer(bh_index);
+	/* Attach the buffer to the inode so that fsync() flushes it */
+	mark_buffer_dirty_inode(bh_index, inode);
+	brelse(bh_index);
+
+	if (ci->starts) {
+		bh_index = ouichefs_getblk_new(inode->i_sb, ci->start_block);
+		if (!bh_index) {
+			ret = -EIO;
+			goto unlock;
+		}
+		lock_buffer(bh_index);
+		memcpy(bh_index->b_data, ci->starts,
+		       sizeof(struct ouichefs_file_start_block));
+		unlock_buffer(bh_index);
+		mark_buffer_dirty_inode(bh_index, inode);
+		brelse(bh_index);
+	}
+	ci->index_dirty = false;
+
+unlock:
+	up_read(&ci->index_sem);
+
+	return ret;
+}
+
+/*
+ * Forget the cached index without writing it back, e.g. when the file is
+ * deleted. index_sem must be held for writing, or the inode must be unused.
+ */
+void ouichefs_index_drop(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	spin_lock(&sbi->index_lru_lock);
+	if (!list_empty(&ci->index_lru)) {
+		list_del_init(&ci->index_lru);
+		sbi->nr_cached_index--;
+	}
+	spin_unlock(&sbi->index_lru_lock);
+
+	kfree(ci->index);
+	ci->index = NULL;
+	ci->index_dirty = false;
+	kfree(ci->starts);
+	ci->starts = NULL;
+	kfree(ci->offsets);
+	ci->offsets = NULL;
+	ci->nr_offsets = 0;
+}
+
+/*
+ * Give a file a start block, so that its slices can start anywhere in their
+ * block. The starts of all its slices are 0 at first.
+ * index_sem must be held for writing.
+ */
+int ouichefs_starts_alloc(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint16_t *starts;
+	uint32_t bno;
+
+	if (ci->starts)
+		return 0;
+
+	starts = kzalloc(sizeof(struct ouichefs_file_start_block), GFP_KERNEL);
+	if (!starts)
+		return -ENOMEM;
+	bno = get_free_block(OUICHEFS_SB(inode->i_sb), ci->index_block);
+	if (!bno) {
+		kfree(starts);
+		return -ENOSPC;
+	}
+
+	ci->start_block = bno;
+	ci->starts = starts;
+	ouichefs_index_mark_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Free the start block of a file once all its slices start at 0 again.
+ * index_sem must be held for writing.
+ */
+void ouichefs_starts_release(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+
+	if (!ci->start_block)
+		return;
+
+	forget_block(sb, ci->start_block);
+	ci->start_block = 0;
+	kfree(ci->starts);
+	ci->starts = NULL;
+	mark_inode_dirty(inode);
+}
+
+static int ouichefs_sorted_cmp(const void *a, const void *b)
+{
+	uint32_t va = *(const uint32_t *)a, vb = *(const uint32_t *)b;
+
+	if (va != vb)
+		return va < vb ? -1 : 1;
+	return 0;
+}
+
+/*
+ * List the non-empty entries of a file sorted by block number, so that the
+ * slices in the same block are next to each other, see sorted_first(). The
+ * array is allocated in *sorted and must be freed by the caller.
+ * Return the number of entries listed, or -ENOMEM.
+ */
+int ouichefs_sort_slices(struct inode *inode,
+			 struct ouichefs_file_index_block *index,
+			 uint32_t **sorted)
+{
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, bli, nr = 0;
+	uint32_t bno;
+
+	*sorted = kmalloc_array(nb_blocks, sizeof(**sorted), GFP_KERNEL);
+	if (!*sorted)
+		return -ENOMEM;
+
+	for (bli = 0; bli < nb_blocks; bli++) {
+		if (!index->blocks[bli])
+			continue;
+		bno = get_block_number(index->blocks[bli]);
+		(*sorted)[nr++] = bno << SORTED_BLI_BITS | bli;
+	}
+	sort(*sorted, nr, sizeof(**sorted), ouichefs_sorted_cmp, NULL);
+
+	return nr;
+}
+
+/* Blocks freed by ouichefs_put_slices(), gathered into runs */
+struct slice_run {
+	struct super_block *sb;
+	uint32_t start;
+	uint32_t len;
+	bool scrub;
+	int nr_freed;
+};
+
+static void slice_run_flush(struct slice_run *run)
+{
+	struct buffer_head *bh;
+	uint32_t i;
+
+	if (!run->len)
+		return;
+
+	if (!run->scrub) {
+		forget_blocks(run->sb, run->start, run->len);
+	} else {
+		/* Zero the blocks, there is no need to read them first */
+		for (i = 0; i < run->len; i++) {
+			bh = sb_getblk(run->sb, run->start + i);
+			if (!bh)
+				continue;
+			lock_buffer(bh);
+			memset(bh->b_data, 0, bh->b_size);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+		put_blocks(OUICHEFS_SB(run->sb), run->start, run->len);
+	}
+	run->nr_freed += run->len;
+	run->len = 0;
+}
+
+static void slice_run_add(struct slice_run *run, uint32_t bno)
+{
+	if (run->len && bno == run->start + run->len) {
+		run->len++;
+		return;
+	}
+	slice_run_flush(run);
+	run->start = bno;
+	run->len = 1;
+}
+
+/*
+ * Clear the entries first to last of a file, and free the blocks that no
+ * other slice is in. With scrub, zeros are written to the freed blocks,
+ * otherwise their buffers are dropped. Blocks that follow each other are
+ * freed together.
+ * Return the number of blocks freed.
+ */
+int ouichefs_put_slices(struct inode *inode,
+			struct ouichefs_file_index_block *index, int first,
+			int last, bool scrub)
+{
+	struct slice_run run = { .sb = inode->i_sb, .scrub = scrub };
+	uint32_t *sorted = NULL, bno;
+	int nr = 0, i, j, bli;
+	bool inside;
+
+	/* Only the slices of files with a start block share blocks */
+	if (OUICHEFS_INODE(inode)->starts)
+		nr = ouichefs_sort_slices(inode, index, &sorted);
+
+	/* A block is freed if all the slices in it are cleared */
+	for (i = 0; i < nr; i = j) {
+		bno = sorted_bno(sorted[i]);
+		inside = true;
+		for (j = i; j < nr && sorted_bno(sorted[j]) == bno; j++) {
+			bli = sorted_bli(sorted[j]);
+			if (bli < first || bli > last)
+				inside = false;
+		}
+		if (inside)
+			slice_run_add(&run, bno);
+	}
+
+	for (bli = first; bli <= last; bli++) {
+		/* Without the list, each slice is checked against the others */
+		if (!sorted && index->blocks[bli] &&
+		    !slice_shared(inode, index, bli))
+			slice_run_add(&run,
+				      get_block_number(index->blocks[bli]));
+		index->blocks[bli] = 0;
+		set_slice_start(inode, bli, 0);
+	}
+	slice_run_flush(&run);
+	kfree(sorted);
+	inode->i_blocks -= run.nr_freed;
+
+	return run.nr_freed;
+}
+
+static unsigned long ouichefs_index_count(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, index_shrinker);
+
+	return READ_ONCE(sbi->nr_cached_index);
+}
+
+/*
+ * Free clean cached indexes, oldest first. Indexes that are in use or dirty
+ * are skipped.
+ */
+static unsigned long ouichefs_index_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, index_shrinker);
+	struct ouichefs_inode_info *ci, *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(busy);
+
+	spin_lock(&sbi->index_lru_lock);
+	list_for_each_entry_safe(ci, tmp, &sbi->index_lru, index_lru) {
+		if (sc->nr_to_scan == 0)
+			break;
+		sc->nr_to_scan--;
+
+		if (!down_write_trylock(&ci->index_sem)) {
+			list_move_tail(&ci->index_lru, &busy);
+			continue;
+		}
+		if (ci->index_dirty) {
+			up_write(&ci->index_sem);
+			list_move_tail(&ci->index_lru, &busy);
+			continue;
+		}
+
+		list_del_init(&ci->index_lru);
+		sbi->nr_cached_index--;
+		kfree(ci->index);
+		ci->index = NULL;
+		kfree(ci->starts);
+		ci->starts = NULL;
+		kfree(ci->offsets);
+		ci->offsets = NULL;
+		ci->nr_offsets = 0;
+		up_write(&ci->index_sem);
+		freed++;
+	}
+	list_splice_tail(&busy, &sbi->index_lru);
+	spin_unlock(&sbi->index_lru_lock);
+
+	return freed;
+}
+
+int ouichefs_index_shrinker_register(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	INIT_LIST_HEAD(&sbi->index_lru);
+	spin_lock_init(&sbi->index_lru_lock);
+	sbi->nr_cached_index = 0;
+
+	sbi->index_shrinker.count_objects = ouichefs_index_count;
+	sbi->index_shrinker.scan_objects = ouichefs_index_scan;
+	sbi->index_shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&sbi->index_shrinker, "ouichefs-index:%s",
+				 sb->s_id);
+}
+
+void ouichefs_index_shrinker_unregister(struct super_block *sb)
+{
+	unregister_shrinker(&OUICHEFS_SB(sb)->index_shrinker);
+}
@@ -11,6 +11,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
@@ -71,6 +72,9 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->start_block = le32_to_cpu(cinode->start_block);
+	ci->nr_slices = le32_to_cpu(cinode->i_slices);
+	ci->alloc_hint = ci->index_block + 1;
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
@@ -92,6 +96,55 @@ failed:
 	return ERR_PTR(ret);
 }
 
+/*
+ * Call fn on each used inode with its copy in the inode store, which may be
+ * older than the in-memory inode. The inode store is read ahead
+ * OUICHEFS_READ_BATCH blocks at a time. Stop at the first error returned by
+ * fn.
+ */
+int ouichefs_for_each_inode(struct super_block *sb,
+			    int (*fn)(struct super_block *sb, uint32_t ino,
+				      struct ouichefs_inode *disk_inode,
+				      void *data),
+			    void *data)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	uint32_t b, k, s, ino;
+	int ret = 0;
+
+	for (b = 0; b < sbi->nr_istore_blocks && !ret; b++) {
+		/* Read the inode store ahead, one batch at a time */
+		if (b % OUICHEFS_READ_BATCH == 0) {
+			blk_start_plug(&plug);
+			for (k = b; k < sbi->nr_istore_blocks &&
+				    k < b + OUICHEFS_READ_BATCH;
+			     k++)
+				sb_breadahead(sb, k + 1);
+			blk_finish_plug(&plug);
+		}
+
+		bh = sb_bread(sb, b + 1);
+		if (!bh)
+			return -EIO;
+
+		for (s = 0; s < OUICHEFS_INODES_PER_BLOCK && !ret; s++) {
+			ino = b * OUICHEFS_INODES_PER_BLOCK + s;
+			if (inode_in_use(sbi, ino))
+				ret = fn(sb, ino,
+					 (struct ouichefs_inode *)bh->b_data +
+						 s,
+					 data);
+		}
+		brelse(bh);
+
+		cond_resched();
+	}
+
+	return ret;
+}
+
 /*
  * Look for dentry in dir.
  * Fill dentry with NULL if not in dir, with the corresponding inode if found.
@@ -162,7 +215,8 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (percpu_counter_read_positive(&sbi->free_inodes) == 0 ||
+	    percpu_counter_read_positive(&sbi->free_blocks) == 0)
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
@@ -177,12 +231,16 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	ci = OUICHEFS_INODE(inode);
 
 	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
+	bno = get_free_block(sbi, 0);
 	if (!bno) {
 		ret = -ENOSPC;
 		goto put_inode;
 	}
 	ci->index_block = bno;
+	ci->start_block = 0;
+	ci->nr_slices = 0;
+	/* Keep the data close to the index */
+	ci->alloc_hint = bno + 1;
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -310,7 +368,7 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
 	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
@@ -354,38 +412,33 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	 * forever. If we fail to scrub a data block, don't fail (too late
 	 * anyway), just put the block and continue.
 	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
 	if (S_ISDIR(inode->i_mode))
 		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, get_block_number(file_block->blocks[i]));
-		bh2 = sb_bread(sb, get_block_number(file_block->blocks[i]));
-
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
+	file_block = ouichefs_index_get(inode, true);
+	if (IS_ERR(file_block))
+		goto clean_inode;
+	if (OUICHEFS_INODE(inode)->nr_slices)
+		ouichefs_put_slices(inode, file_block, 0,
+				    OUICHEFS_INODE(inode)->nr_slices - 1, true);
+	ouichefs_starts_release(inode);
+	/* The index block is scrubbed on disk, forget the cached copy */
+	ouichefs_index_drop(inode);
+	ouichefs_index_put(inode, true);
 
 scrub:
 	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		goto clean_inode;
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
 clean_inode:
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
+	OUICHEFS_INODE(inode)->nr_slices = 0;
+	ouichefs_offsets_invalidate(inode, 0);
 	OUICHEFS_INODE(inode)->index_block = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
@@ -5,6 +5,7 @@
 #include "linux/file.h"
 #include "linux/buffer_head.h"
 #include "linux/ctype.h"
+#include "linux/mount.h"
 #include "ouichefs.h"
 #include "ioctl.h"
 #include "bitmap.h"
@@ -26,12 +27,11 @@ static int ouichefs_ioctl_file_info(struct file *file,
 	struct inode *inode = file->f_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index = NULL;
-	struct buffer_head *bh_index = NULL;
 	uint32_t block_size;
-	uint32_t wasted = 0;
 	uint32_t block;
 	uint32_t nb_partial_block = 0;
 	uint32_t total_wasted = 0;
+	uint32_t allocated;
 
 	if (display)
 		pr_info("File information:\n"
@@ -40,40 +40,46 @@ static int ouichefs_ioctl_file_info(struct file *file,
 			"\tblocks: ",
 			inode->i_size, inode->i_blocks - 1);
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index) {
-		ret = -EFAULT;
+	/* Get the cached index block */
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
 		pr_err("could not read index block\n");
 		goto end;
 	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
-	if (display && inode->i_blocks > 10)
+	if (display && ci->nr_slices > 9)
 		pr_cont("\n");
 
-	for (int i = 0; i < inode->i_blocks - 1; i++) {
+	for (int i = 0; i < ci->nr_slices; i++) {
 		block = index->blocks[i];
 		block_size = get_block_size(block);
-		wasted = OUICHEFS_BLOCK_SIZE - block_size;
-		total_wasted += wasted;
-		if (wasted != 0)
+		if (block_size != OUICHEFS_BLOCK_SIZE)
 			nb_partial_block++;
 
 		if (display)
 			pr_cont("%u:%u", get_block_number(block), block_size);
-		if (display && (i < inode->i_blocks - 2))
+		if (display && (i < ci->nr_slices - 1))
 			pr_cont(", ");
 		if (display && (i % 10 == 9))
 			pr_cont("\n");
 	}
 
+	/*
+	 * Slices may share blocks, the waste is that of the blocks of the
+	 * file. A block of zeros shared by several slices holds more bytes of
+	 * the file than its size, and wastes nothing.
+	 */
+	allocated = (inode->i_blocks - 1) * OUICHEFS_BLOCK_SIZE;
+	if (allocated > inode->i_size)
+		total_wasted = allocated - inode->i_size;
+
 	if (display)
 		pr_cont("\n\twasted: %d\n"
 			"\tpartial block: %d\n",
 			total_wasted, nb_partial_block);
 
-	brelse(bh_index);
+	ouichefs_index_put(inode, false);
 
 	user_file_info.wasted = total_wasted;
 	user_file_info.nb_blocks = inode->i_blocks - 1;
@@ -116,9 +122,8 @@ static void pr_buf(char *buf, uint32_t len)
 static int ouichefs_ioctl_file_block_print(struct file *file)
 {
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index = NULL;
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
+	struct buffer_head *bh_data = NULL;
 	int ret = 0;
 
 	pr_info("file information:\n\n"
@@ -126,16 +131,15 @@ static int ouichefs_ioctl_file_block_print(struct file *file)
 		"\tdata blocks number: %llu\n\n",
 		inode->i_size, inode->i_blocks - 1);
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index) {
-		ret = -EFAULT;
+	/* Get the cached index block */
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
 		pr_err("could not read index block\n");
 		goto end;
 	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
-	for (int i = 0; i < inode->i_blocks - 1; i++) {
+	for (int i = 0; i < OUICHEFS_INODE(inode)->nr_slices; i++) {
 		uint32_t block_size, bno;
 
 		bno = index->blocks[i];
@@ -147,22 +151,185 @@ static int ouichefs_ioctl_file_block_print(struct file *file)
 		block_size = get_block_size(bno);
 		bh_data = sb_bread(inode->i_sb, get_block_number(bno));
 		if (!bh_data)
-			goto end;
+			break;
 
 		pr_cont("\t\t");
-		pr_buf(bh_data->b_data, block_size);
+		pr_buf(bh_data->b_data + get_slice_start(inode, i), block_size);
 		pr_cont("\n");
+		brelse(bh_data);
 	}
 
-	brelse(bh_index);
+	ouichefs_index_put(inode, false);
 
 end:
 	return ret;
 }
 
+static int ouichefs_ioctl_free_info(struct file *file,
+				    struct free_info __user *argp)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+	struct free_info info;
+	int i, ret;
+
+	if (copy_from_user(&info, argp, sizeof(info))) {
+		pr_err("copy_from_user() failed\n");
+		return -EFAULT;
+	}
+
+	/* The extents of all the groups are counted, not only the loaded ones */
+	ret = ouichefs_alloc_load_all(sbi);
+	if (ret)
+		return ret;
+	ouichefs_free_info(sbi, &info);
+
+	if (!info.hide_display) {
+		pr_info("Free space information:\n"
+			"\tfree blocks: %d\n"
+			"\tfree extents: %d\n"
+			"\tlargest extent: %d\n"
+			"\textents by size:\n",
+			info.nr_free_blocks, info.nr_extents, info.largest);
+		for (i = 0; i < OUICHEFS_FREE_HIST_SIZE; i++)
+			if (info.histogram[i])
+				pr_cont("\t\t%d+: %d\n", 1 << i,
+					info.histogram[i]);
+	}
+
+	if (copy_to_user(argp, &info, sizeof(info))) {
+		pr_err("copy_to_user() failed\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
 static int ouichefs_ioctl_defrag(struct file *file)
 {
-	return ouichefs_defrag(file);
+	struct inode *inode = file->f_inode;
+	int ret;
+
+	inode_lock(inode);
+	ret = ouichefs_defrag(file);
+	inode_unlock(inode);
+
+	return ret;
+}
+
+static int ouichefs_ioctl_defrag_relocate(struct file *file)
+{
+	struct inode *inode = file->f_inode;
+	int ret;
+
+	inode_lock(inode);
+	ret = ouichefs_defrag_relocate(inode);
+	inode_unlock(inode);
+
+	return ret;
+}
+
+static int ouichefs_ioctl_defrag_step(struct file *file, void __user *argp)
+{
+	struct defrag_step step;
+	int ret;
+
+	if (copy_from_user(&step, argp, sizeof(step))) {
+		pr_err("copy_from_user() failed\n");
+		return -EFAULT;
+	}
+
+	ret = ouichefs_defrag_step(file->f_inode, &step);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(argp, &step, sizeof(step))) {
+		pr_err("copy_to_user() failed\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int ouichefs_ioctl_defrag_volume(struct file *file,
+					struct volume_defrag_info __user *argp)
+{
+	struct volume_defrag_info info;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&info, argp, sizeof(info))) {
+		pr_err("copy_from_user() failed\n");
+		return -EFAULT;
+	}
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	ret = ouichefs_defrag_volume(file->f_inode->i_sb, &info);
+	mnt_drop_write_file(file);
+	if (ret)
+		return ret;
+
+	if (!info.hide_display)
+		pr_info("Volume defragmentation:\n"
+			"\tfiles: %d\n"
+			"\tfragmented files: %d\n"
+			"\tdefragmented files: %d\n"
+			"\trelocated files: %d\n"
+			"\twasted: %lld -> %lld\n"
+			"\tdata blocks: %lld -> %lld\n",
+			info.nr_files, info.nr_fragmented, info.nr_defragged,
+			info.nr_relocated,
+			info.wasted_before, info.wasted_after,
+			info.blocks_before, info.blocks_after);
+
+	if (copy_to_user(argp, &info, sizeof(info))) {
+		pr_err("copy_to_user() failed\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int ouichefs_ioctl_compact(struct file *file,
+				  struct compact_info __user *argp)
+{
+	struct compact_info info;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&info, argp, sizeof(info))) {
+		pr_err("copy_from_user() failed\n");
+		return -EFAULT;
+	}
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	ret = ouichefs_compact(file->f_inode->i_sb, &info);
+	mnt_drop_write_file(file);
+	if (ret)
+		return ret;
+
+	if (!info.hide_display)
+		pr_info("Free space compaction:\n"
+			"\tblocks moved: %d\n"
+			"\tfree extents: %d -> %d\n"
+			"\tlargest extent: %d -> %d\n",
+			info.nr_moved, info.nr_extents_before,
+			info.nr_extents_after, info.largest_before,
+			info.largest_after);
+
+	if (copy_to_user(argp, &info, sizeof(info))) {
+		pr_err("copy_to_user() failed\n");
+		return -EFAULT;
+	}
+
+	return 0;
 }
 
 long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -172,6 +339,11 @@ long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 	void __user *argp = (void __user *)arg;
 
+	/* Directories only take the volume-wide commands */
+	if (S_ISDIR(file->f_inode->i_mode) && cmd != OUICHEFS_IOC_FREE_INFO &&
+	    cmd != OUICHEFS_IOC_DEFRAG_VOLUME && cmd != OUICHEFS_IOC_COMPACT)
+		return -ENOTTY;
+
 	switch (cmd) {
 	case OUICHEFS_IOC_FILE_INFO:
 		return ouichefs_ioctl_file_info(file, argp);
@@ -179,6 +351,16 @@ long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return ouichefs_ioctl_defrag(file);
 	case OUICHEFS_IOC_FILE_BLOCK_PRINT:
 		return ouichefs_ioctl_file_block_print(file);
+	case OUICHEFS_IOC_FREE_INFO:
+		return ouichefs_ioctl_free_info(file, argp);
+	case OUICHEFS_IOC_DEFRAG_STEP:
+		return ouichefs_ioctl_defrag_step(file, argp);
+	case OUICHEFS_IOC_DEFRAG_RELOCATE:
+		return ouichefs_ioctl_defrag_relocate(file);
+	case OUICHEFS_IOC_DEFRAG_VOLUME:
+		return ouichefs_ioctl_defrag_volume(file, argp);
+	case OUICHEFS_IOC_COMPACT:
+		return ouichefs_ioctl_compact(file, argp);
 	default:
 		return -EINVAL;
 	}
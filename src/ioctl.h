@@ -9,9 +9,69 @@ struct file_info {
 	int hide_display;
 };
 
+#define OUICHEFS_FREE_HIST_SIZE 16
+
+/* Free space, histogram[i] counts free extents of 2^i to 2^(i+1) - 1 blocks */
+struct free_info {
+	int nr_free_blocks;
+	int nr_extents;
+	int largest;
+	int histogram[OUICHEFS_FREE_HIST_SIZE];
+	int hide_display;
+};
+
+/*
+ * Budgeted defrag: call again with the returned cursor until done is set.
+ * A budget of 0 means no limit.
+ */
+struct defrag_step {
+	int cursor; /* in/out: first index entry not packed yet */
+	int budget_blocks; /* in: number of blocks to read at most */
+	int budget_us; /* in: time to spend at most, in microseconds */
+	int blocks_read; /* out: blocks read by this call */
+	int blocks_written; /* out: blocks written by this call */
+	int blocks_freed; /* out: blocks freed by this call */
+	int nb_blocks; /* out: data blocks of the file */
+	int done; /* out: 1 once the whole file is packed */
+};
+
+/* Volume-wide defrag of the files that waste the most space */
+struct volume_defrag_info {
+	int max_files; /* in: number of files to defragment, 0 for all */
+	int relocate; /* in: also move each file into a single extent */
+	int nr_files; /* out: regular files on the volume */
+	int nr_fragmented; /* out: files wasting space before */
+	int nr_defragged; /* out: files defragmented */
+	int nr_relocated; /* out: files moved into a single extent */
+	long long wasted_before; /* out: bytes wasted by all the files */
+	long long wasted_after;
+	long long blocks_before; /* out: data blocks of all the files */
+	long long blocks_after;
+	int hide_display;
+};
+
+/* Free space compaction, moving used blocks to the start of the volume */
+struct compact_info {
+	int max_moves; /* in: number of blocks to move at most, 0 for all */
+	int nr_moved; /* out: blocks moved */
+	int nr_extents_before; /* out: free extents */
+	int nr_extents_after;
+	int largest_before; /* out: blocks in the largest free extent */
+	int largest_after;
+	int hide_display;
+};
+
 #define OUICHEFS_IOCTL_MAGIC 'N'
 #define OUICHEFS_IOC_FILE_INFO _IOWR(OUICHEFS_IOCTL_MAGIC, 1, struct file_info)
 #define OUICHEFS_IOC_DEFRAG _IO(OUICHEFS_IOCTL_MAGIC, 2)
 #define OUICHEFS_IOC_FILE_BLOCK_PRINT _IO(OUICHEFS_IOCTL_MAGIC, 3)
+#define OUICHEFS_IOC_FREE_INFO _IOWR(OUICHEFS_IOCTL_MAGIC, 4, struct free_info)
+#define OUICHEFS_IOC_DEFRAG_STEP \
+	_IOWR(OUICHEFS_IOCTL_MAGIC, 5, struct defrag_step)
+#define OUICHEFS_IOC_DEFRAG_VOLUME \
+	_IOWR(OUICHEFS_IOCTL_MAGIC, 6, struct volume_defrag_info)
+/* Defrag, then move the file into one extent. Return 1 if it was moved */
+#define OUICHEFS_IOC_DEFRAG_RELOCATE _IO(OUICHEFS_IOCTL_MAGIC, 7)
+#define OUICHEFS_IOC_COMPACT _IOWR(OUICHEFS_IOCTL_MAGIC, 8, struct compact_info)
 
 #endif /* IOCTL_H */
@@ -8,6 +8,11 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/shrinker.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -17,6 +22,13 @@
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
+#define OUICHEFS_BGROUP_BITS (OUICHEFS_BLOCK_SIZE * 8) /* Blocks per group */
+
+/* Number of data blocks submitted together by the read paths */
+#define OUICHEFS_READ_BATCH 32
+/* Bounds of the reservation window of a file that grows, in blocks */
+#define OUICHEFS_RSV_MIN 8
+#define OUICHEFS_RSV_MAX 128
 
 #define MASK_BLOCK_SIZE 0x7ff80000
 #define MASK_BLOCK_NUM  0x0007ffff
@@ -55,16 +67,42 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t start_block; /* Block with the start of each slice, or 0 */
+	uint32_t i_slices; /* Used entries of the index block */
 };
 
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	uint32_t start_block;
+	int nr_slices; /* Used entries of the index, slices may share blocks */
+	uint16_t *starts; /* Cached start block, NULL if all starts are 0 */
+	struct ouichefs_file_index_block *index; /* Cached index block */
+	bool index_dirty; /* Cached index not written back yet */
+	struct rw_semaphore index_sem; /* Protects index, see offsets_lock */
+	struct list_head index_lru; /* Entry in sbi->index_lru */
+	uint32_t *offsets; /* Cumulative end offset of each data block */
+	int nr_offsets; /* Number of up-to-date entries in offsets */
+	spinlock_t offsets_lock; /* Readers extend offsets under it */
+	uint32_t alloc_hint; /* Block after the last one allocated to the file */
+	uint32_t rsv_start; /* First block of the reservation window */
+	uint32_t rsv_len; /* Number of blocks left in the window */
+	bool rsv_keep; /* Window asked for by fallocate(), kept across closes */
+	struct list_head defrag_list; /* Entry in sbi->defrag_list */
 	struct inode vfs_inode;
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
+/* Free extents of a group of blocks, see bitmap.c */
+struct ouichefs_bgroup {
+	spinlock_t lock; /* Protects the extents and bfree bits of the group */
+	struct rb_root by_start; /* Free extents sorted by start */
+	struct rb_root by_len; /* Free extents sorted by length */
+	uint32_t nr_extents; /* Number of free extents */
+	uint32_t largest; /* Length of the largest extent, read without lock */
+};
+
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
 
@@ -78,14 +116,66 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	struct buffer_head **ifree_bh; /* Pinned free inodes bitmap blocks */
+	struct buffer_head **bfree_bh; /* Pinned free blocks bitmap blocks */
+	/* A NULL entry in ifree_bh or bfree_bh is a block not read yet */
+	unsigned long *ifree_dirty; /* ifree blocks changed since last sync */
+	unsigned long *bfree_dirty; /* bfree blocks changed since last sync */
+
+	struct shrinker index_shrinker; /* Drops clean cached indexes */
+	struct list_head index_lru; /* Inodes with a cached index */
+	spinlock_t index_lru_lock; /* Protects index_lru */
+	unsigned long nr_cached_index; /* Number of cached indexes */
+
+	struct percpu_counter free_inodes; /* Live nr_free_inodes */
+	struct percpu_counter free_blocks; /* Live nr_free_blocks */
+	uint32_t __percpu *inode_cursor; /* Start of the next inode search */
+	uint32_t __percpu *block_cursor; /* Start of the next block search */
+
+	struct super_block *sb; /* To read bitmap blocks on demand */
+	struct mutex bitmap_mutex; /* Serialises bitmap block reads */
+	struct list_head deferred_frees; /* Frees of groups not read yet */
+	atomic_t nr_rsv_blocks; /* Blocks in windows, still free on disk */
+	struct work_struct prefetch_work; /* Reads bitmaps after the mount */
+	bool prefetch_stop; /* Stop prefetch_work, the volume goes away */
+
+	uint32_t nr_bgroups; /* Number of groups of blocks */
+	uint32_t nr_bgroups_loaded; /* Groups whose bitmap block is read */
+	atomic_t *bgroup_free; /* Number of free blocks in each group */
+	unsigned long *bgroup_map; /* Groups with at least one free block */
+
+	struct ouichefs_bgroup *bgroups; /* Free extents of each group */
+
+	struct workqueue_struct *defrag_wq; /* Runs defrag_work */
+	struct delayed_work defrag_work; /* Compacts the queued files */
+	struct list_head defrag_list; /* Files waiting for defrag_work */
+	spinlock_t defrag_lock; /* Protects defrag_list and defrag_stop */
+	bool defrag_stop; /* The volume is being unmounted */
+};
+
+/* Background defragmentation policy, set in /sys/kernel/ouichefs/defrag */
+struct ouichefs_defrag_params {
+	unsigned int enabled; /* Run the background worker */
+	unsigned int min_waste; /* Wasted bytes that make a file a candidate */
+	unsigned int min_partial; /* Partial blocks that do the same */
+	unsigned int idle_ms; /* Time without writes before the worker runs */
+	unsigned int rate; /* Maximum number of files compacted per second */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * Offset in its block of the first byte of each slice of a file. Splitting a
+ * slice leaves both halves in the same block, so that inserts never copy the
+ * data already written. Files that never had a slice split have no start
+ * block, all their slices start at 0.
+ */
+struct ouichefs_file_start_block {
+	uint16_t starts[OUICHEFS_BLOCK_SIZE >> 2];
+};
+
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -99,11 +189,46 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
+int ouichefs_init_extent_cache(void);
+void ouichefs_destroy_extent_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+int ouichefs_for_each_inode(struct super_block *sb,
+			    int (*fn)(struct super_block *sb, uint32_t ino,
+				      struct ouichefs_inode *disk_inode,
+				      void *data),
+			    void *data);
+
+/* index cache functions */
+struct ouichefs_file_index_block *ouichefs_index_get(struct inode *inode,
+						     bool write);
+struct ouichefs_file_index_block *ouichefs_index_tryget(struct inode *inode,
+							bool write);
+void ouichefs_index_put(struct inode *inode, bool write);
+void ouichefs_index_mark_dirty(struct inode *inode);
+int ouichefs_index_sync(struct inode *inode);
+void ouichefs_index_drop(struct inode *inode);
+int ouichefs_starts_alloc(struct inode *inode);
+void ouichefs_starts_release(struct inode *inode);
+int ouichefs_sort_slices(struct inode *inode,
+			 struct ouichefs_file_index_block *index,
+			 uint32_t **sorted);
+int ouichefs_put_slices(struct inode *inode,
+			struct ouichefs_file_index_block *index, int first,
+			int last, bool scrub);
+int ouichefs_index_shrinker_register(struct super_block *sb);
+void ouichefs_index_shrinker_unregister(struct super_block *sb);
 
 /* block function */
-int find_block_pos(loff_t pos, struct ouichefs_file_index_block *index,
-		   int nb_blocks, int *block_index, int *logical_pos);
+int find_block_pos(struct inode *inode, loff_t pos,
+		   struct ouichefs_file_index_block *index, int nb_blocks,
+		   int *block_index, int *logical_pos);
+void ouichefs_offsets_invalidate(struct inode *inode, int block_index);
+
+/* read functions */
+int ouichefs_bread_batch(struct super_block *sb, uint32_t *bnos, int nr,
+			 struct buffer_head **bhs);
+int ouichefs_bh_wait(struct buffer_head *bh);
+bool ouichefs_block_cached(struct super_block *sb, uint32_t bno);
 
 /* file functions */
 extern struct file_operations ouichefs_file_ops;
@@ -114,16 +239,34 @@ ssize_t ouichefs_read(struct file *file, char __user *buff, size_t size,
 ssize_t ouichefs_write(struct file *file, const char __user *buff,
 			      size_t size, loff_t *pos);
 long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
-ssize_t ouichefs_light_read(struct file *file, char __user *buff, size_t size,
-			     loff_t *pos);
-ssize_t ouichefs_light_write(struct file *file, const char __user *buff,
-			      size_t size, loff_t *pos);
-ssize_t ouichefs_light_write(struct file *file, const char __user *buff,
-			      size_t size, loff_t *pos);
+ssize_t ouichefs_light_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t ouichefs_light_write_iter(struct kiocb *iocb, struct iov_iter *from);
+long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			loff_t len);
+struct buffer_head *ouichefs_getblk_new(struct super_block *sb, uint32_t bno);
 int ouichefs_defrag(struct file *file);
+int ouichefs_defrag_relocate(struct inode *inode);
+struct defrag_step;
+int ouichefs_defrag_step(struct inode *inode, struct defrag_step *step);
+struct volume_defrag_info;
+int ouichefs_defrag_volume(struct super_block *sb,
+			   struct volume_defrag_info *info);
+
+/* background defrag functions */
+extern struct ouichefs_defrag_params ouichefs_defrag_params;
+int ouichefs_defrag_inode(struct inode *inode);
+void ouichefs_defrag_note(struct inode *inode);
+void ouichefs_defrag_forget(struct inode *inode);
+int ouichefs_defrag_init(struct super_block *sb);
+void ouichefs_defrag_stop(struct super_block *sb);
+void ouichefs_defrag_free(struct super_block *sb);
 ssize_t ouichefs_read_cached(struct file *file, char __user *buff, size_t size,
 			     loff_t *pos);
 
+/* free space compaction functions */
+struct compact_info;
+int ouichefs_compact(struct super_block *sb, struct compact_info *info);
+
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
 #define OUICHEFS_INODE(inode) \
@@ -5,6 +5,8 @@
 #include "linux/buffer_head.h"
 #include "linux/pagemap.h"
 #include "linux/mpage.h"
+#include "linux/blkdev.h"
+#include "linux/uio.h"
 #include "ouichefs.h"
 #include "bitmap.h"
 
@@ -20,28 +22,81 @@ int read_flags(struct file *file)
 }
 
 /*
- * Normal write.
+ * Get the buffers of nr blocks and submit the reads of those that are not up
+ * to date together, in a single plug. Use ouichefs_bh_wait() before reading
+ * a buffer and brelse() it afterward.
+ * Return -ENOMEM if a buffer could not be obtained, nothing is held then.
+ */
+int ouichefs_bread_batch(struct super_block *sb, uint32_t *bnos, int nr,
+			 struct buffer_head **bhs)
+{
+	struct blk_plug plug;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		bhs[i] = sb_getblk(sb, bnos[i]);
+		if (!bhs[i]) {
+			while (i--)
+				brelse(bhs[i]);
+			return -ENOMEM;
+		}
+	}
+
+	blk_start_plug(&plug);
+	bh_readahead_batch(nr, bhs, 0);
+	blk_finish_plug(&plug);
+
+	return 0;
+}
+
+/*
+ * Wait for a buffer submitted by ouichefs_bread_batch(). Read it
+ * synchronously if it could not be submitted with the batch.
+ * Return -EIO if the buffer could not be read.
+ */
+int ouichefs_bh_wait(struct buffer_head *bh)
+{
+	wait_on_buffer(bh);
+	if (buffer_uptodate(bh))
+		return 0;
+	return bh_read(bh, 0) < 0 ? -EIO : 0;
+}
+
+/*
+ * Return true if the buffer of block bno is cached and up to date, so that an
+ * IOCB_NOWAIT request can use it without waiting for the device.
+ */
+bool ouichefs_block_cached(struct super_block *sb, uint32_t bno)
+{
+	struct buffer_head *bh = sb_find_get_block(sb, bno);
+	bool cached = bh && buffer_uptodate(bh);
+
+	brelse(bh);
+	return cached;
+}
+
+/*
+ * Normal read.
  */
 
 ssize_t ouichefs_read(struct file *file, char __user *buff, size_t size,
 		      loff_t *pos)
 {
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index, *bh_data;
+	struct buffer_head *bhs[OUICHEFS_READ_BATCH];
+	uint32_t bnos[OUICHEFS_READ_BATCH];
 	size_t remaining_read = size, readen = 0;
-	int last_block_size, nb_blocks, logical_block_index, logical_pos;
+	int last_block_size, nb_blocks, logical_block_index, logical_pos, nr, i;
 
 	/* Check if we can read */
 	if (read_flags(file) < 0)
 		return -EINVAL;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index)
+	/* Get the cached index block */
+	index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index))
 		goto read_end;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/*
 	 * Get the size of the last block to read. Needed to manage file
@@ -51,56 +106,64 @@ ssize_t ouichefs_read(struct file *file, char __user *buff, size_t size,
 	if (last_block_size == 0 && inode->i_size != 0)
 		last_block_size = OUICHEFS_BLOCK_SIZE;
 
-	/* Number of data blocks in the file (without the index block) */
-	nb_blocks = inode->i_blocks - 1;
+	/* Number of slices of the file, from its index */
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
 	/* Index of the block where the cursor is */
 	logical_block_index = (*pos) / OUICHEFS_BLOCK_SIZE;
 	/* Cursor position inside the current block */
 	logical_pos = (*pos) % OUICHEFS_BLOCK_SIZE;
 
 	while (remaining_read && (logical_block_index < nb_blocks)) {
-		uint32_t bno;
-		size_t available_size, len;
-		char *block;
-
-		/* Read data block from disk */
-		bno = index->blocks[logical_block_index];
-		bh_data = sb_bread(inode->i_sb, bno);
-		if (!bh_data)
-			goto free_bh_index;
-
-		/* Available size between the cursor and the end of the block */
-		available_size = OUICHEFS_BLOCK_SIZE - logical_pos;
-		if (logical_block_index == nb_blocks - 1)
-			available_size = last_block_size - logical_pos;
-		if (available_size == 0)
-			goto free_bh_data;
-
-		/* Do not read more than what's available and asked */
-		len = min(available_size, remaining_read);
-		block = (char *)bh_data->b_data;
-
-		if (copy_to_user(buff + (size - remaining_read),
-				 block + logical_pos, len)) {
-			pr_err("copy_to_user() failed\n");
-			goto free_bh_data;
+		/* Submit the reads of the blocks covering the request at once */
+		nr = min3(nb_blocks - logical_block_index, OUICHEFS_READ_BATCH,
+			  (int)DIV_ROUND_UP(logical_pos + remaining_read,
+					    OUICHEFS_BLOCK_SIZE));
+		for (i = 0; i < nr; i++)
+			bnos[i] = index->blocks[logical_block_index + i];
+		if (ouichefs_bread_batch(inode->i_sb, bnos, nr, bhs))
+			goto put_index;
+
+		for (i = 0; i < nr; i++) {
+			size_t available_size, len;
+			char *block;
+
+			if (ouichefs_bh_wait(bhs[i]))
+				goto free_bhs;
+
+			/* Available size between the cursor and the end of the block */
+			available_size = OUICHEFS_BLOCK_SIZE - logical_pos;
+			if (logical_block_index == nb_blocks - 1)
+				available_size = last_block_size - logical_pos;
+			if (available_size == 0)
+				goto free_bhs;
+
+			/* Do not read more than what's available and asked */
+			len = min(available_size, remaining_read);
+			block = (char *)bhs[i]->b_data;
+
+			if (copy_to_user(buff + (size - remaining_read),
+					 block + logical_pos, len)) {
+				pr_err("copy_to_user() failed\n");
+				goto free_bhs;
+			}
+
+			remaining_read -= len;
+			logical_block_index += 1;
+			/* The cursor position will start at 0 in subsequent blocks */
+			logical_pos = 0;
+
+			brelse(bhs[i]);
 		}
-
-		remaining_read -= len;
-		logical_block_index += 1;
-		/* The cursor position will start at 0 in subsequent blocks */
-		logical_pos = 0;
-
-		brelse(bh_data);
 	}
 
-	goto free_bh_index;
+	goto put_index;
 
-free_bh_data:
-	brelse(bh_data);
+free_bhs:
+	for (; i < nr; i++)
+		brelse(bhs[i]);
 
-free_bh_index:
-	brelse(bh_index);
+put_index:
+	ouichefs_index_put(inode, false);
 
 read_end:
 	readen = size - remaining_read;
@@ -111,157 +174,149 @@ read_end:
 
 /*
  * Read that support with insertion.
+ * Data is copied straight from the block buffers to the iterator, so this
+ * serves read(), readv() and io_uring alike.
  */
 
-ssize_t ouichefs_light_read(struct file *file, char __user *buff, size_t size,
-			    loff_t *pos)
+ssize_t ouichefs_light_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct inode *inode = file_inode(iocb->ki_filp);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index, *bh_data;
-	size_t remaining_read = size;
-	int nb_blocks, logical_block_index, logical_pos;
+	struct buffer_head *bhs[OUICHEFS_READ_BATCH];
+	uint32_t bnos[OUICHEFS_READ_BATCH];
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	size_t size = iov_iter_count(to), remaining_read = size, readen;
+	int nb_blocks, logical_block_index, logical_pos, nr, i;
+	ssize_t ret = 0;
+	long wanted;
 
 	/* Check if we can read */
-	if (read_flags(file) < 0)
+	if (read_flags(iocb->ki_filp) < 0)
 		return -EINVAL;
+	if (!size)
+		return 0;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index)
-		goto read_end;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	/* Get the cached index block, without sleeping if asked to */
+	if (nowait)
+		index = ouichefs_index_tryget(inode, false);
+	else
+		index = ouichefs_index_get(inode, false);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
 
-	/* Number of data blocks in the file (without the index block). */
-	nb_blocks = inode->i_blocks - 1;
+	/* Number of slices of the file, from its index. */
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
 
 	/* Find the index of the block where the cursor is. */
-	if (find_block_pos(*pos, index, nb_blocks, &logical_block_index,
-			   &logical_pos))
-		goto read_end;
+	if (find_block_pos(inode, iocb->ki_pos, index, nb_blocks,
+			   &logical_block_index, &logical_pos))
+		goto put_index;
 
 	while (remaining_read && (logical_block_index < nb_blocks)) {
-		uint32_t bno;
-		size_t available_size, len;
-		char *block;
-
-		/* Read data block from disk */
-		bno = index->blocks[logical_block_index];
-		bh_data = sb_bread(inode->i_sb, get_block_number(bno));
-		if (!bh_data)
-			goto read_end;
-
-		/* Available size between the cursor and the end of the block */
-		available_size = get_block_size(bno) - logical_pos;
-		if (available_size <= 0)
-			goto free_bh_data;
-
-		/* Do not read more than what's available and asked */
-		len = min(available_size, remaining_read);
-		block = (char *)bh_data->b_data;
-
-		if (copy_to_user(buff + (size - remaining_read),
-				 block + logical_pos, len)) {
-			pr_err("copy_to_user() failed\n");
-			goto free_bh_data;
+		/* Submit the reads of the blocks covering the request at once */
+		wanted = logical_pos + remaining_read;
+		for (nr = 0; nr < OUICHEFS_READ_BATCH && wanted > 0 &&
+			     logical_block_index + nr < nb_blocks;
+		     nr++) {
+			uint32_t bno = index->blocks[logical_block_index + nr];
+
+			bnos[nr] = get_block_number(bno);
+			/* Do not submit reads if asked not to wait for them */
+			if (nowait &&
+			    !ouichefs_block_cached(inode->i_sb, bnos[nr])) {
+				if (!nr)
+					ret = -EAGAIN;
+				break;
+			}
+			wanted -= get_block_size(bno);
+		}
+		if (!nr)
+			goto put_index;
+		ret = ouichefs_bread_batch(inode->i_sb, bnos, nr, bhs);
+		if (ret)
+			goto put_index;
+
+		for (i = 0; i < nr; i++) {
+			uint32_t bno = index->blocks[logical_block_index];
+			size_t available_size, len, copied;
+			char *block;
+
+			ret = ouichefs_bh_wait(bhs[i]);
+			if (ret)
+				goto free_bhs;
+
+			/*
+			 * Available size between the cursor and the end of the
+			 * block. Nothing is left when the cursor is at the end
+			 * of the block, continue with the next one.
+			 */
+			available_size = get_block_size(bno) - logical_pos;
+
+			/* Do not read more than what's available and asked */
+			len = min(available_size, remaining_read);
+			block = (char *)bhs[i]->b_data +
+				get_slice_start(inode, logical_block_index);
+
+			copied = copy_to_iter(block + logical_pos, len, to);
+			remaining_read -= copied;
+			if (copied != len) {
+				ret = -EFAULT;
+				goto free_bhs;
+			}
+
+			logical_block_index += 1;
+			/* The cursor position will start at 0 in subsequent blocks */
+			logical_pos = 0;
+
+			brelse(bhs[i]);
 		}
-
-		remaining_read -= len;
-		logical_block_index += 1;
-		/* The cursor position will start at 0 in subsequent blocks */
-		logical_pos = 0;
-
-		brelse(bh_data);
 	}
 
-	goto read_end;
+	goto put_index;
 
-free_bh_data:
-	brelse(bh_data);
+free_bhs:
+	for (; i < nr; i++)
+		brelse(bhs[i]);
 
-read_end:
-	brelse(bh_index);
+put_index:
+	ouichefs_index_put(inode, false);
 
-	size_t readen = size - remaining_read;
-	*pos += readen;
+	/* Report an error only if nothing could be read */
+	readen = size - remaining_read;
+	if (!readen)
+		return ret;
+	iocb->ki_pos += readen;
 
 	return readen;
 }
 
 /*
  * Read that support with insertion using page cache.
+ * The page cache maps the logical bytes of the file (see ouichefs_aops), so
+ * this is a plain page cache read, with batched lookups and readahead.
  */
 
 ssize_t ouichefs_read_cached(struct file *file, char __user *buff, size_t size,
 			     loff_t *pos)
 {
-	struct inode *inode = file->f_inode;
-	struct address_space *mapping = inode->i_mapping;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	struct page *page;
-	int remaining_read = size, logical_pos, nb_blocks, block_size,
-	    available_size, len, logical_block_index;
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
 
 	/* Check if we can read */
 	if (read_flags(file) < 0)
 		return -EINVAL;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index)
-		goto read_end;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	ret = import_ubuf(ITER_DEST, buff, size, &iter);
+	if (ret)
+		return ret;
 
-	/* Number of data blocks in the file (without the index block). */
-	nb_blocks = inode->i_blocks - 1;
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = *pos;
 
-	/* Find the index of the block where the cursor is. */
-	if (find_block_pos(*pos, index, nb_blocks, &logical_block_index,
-			   &logical_pos))
-		goto read_end;
+	ret = filemap_read(&kiocb, &iter, 0);
+	if (ret > 0)
+		*pos = kiocb.ki_pos;
 
-	while (remaining_read && (logical_block_index < nb_blocks)) {
-		page = read_mapping_page(mapping, logical_block_index, NULL);
-		if (IS_ERR(page))
-			goto read_end;
-
-		/* Available size between the cursor and the end of the block */
-		block_size = get_block_size(index->blocks[logical_block_index]);
-		available_size = block_size - logical_pos;
-		if (available_size <= 0)
-			goto free_page;
-
-		/* Do not read more than what's available and asked */
-		len = min(available_size, remaining_read);
-
-		if (copy_to_user(buff, page_address(page) + logical_pos, len)) {
-			pr_err("copy_to_user() failed\n");
-			goto free_page;
-		}
-
-		remaining_read -= len;
-		logical_block_index++;
-		/* The cursor position will start at 0 in subsequent blocks */
-		logical_pos = 0;
-
-		unlock_page(page);
-		put_page(page);
-	}
-
-	goto read_end;
-
-free_page:
-	unlock_page(page);
-	put_page(page);
-
-read_end:
-	brelse(bh_index);
-
-	size_t readen = size - remaining_read;
-	*pos += readen;
-
-	return readen;
+	return ret;
 }
@@ -14,6 +14,7 @@
 #include <linux/statfs.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
 
 static struct kmem_cache *ouichefs_inode_cache;
 
@@ -40,6 +41,20 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
+	ci->index = NULL;
+	ci->index_dirty = false;
+	init_rwsem(&ci->index_sem);
+	INIT_LIST_HEAD(&ci->index_lru);
+	ci->offsets = NULL;
+	ci->nr_offsets = 0;
+	spin_lock_init(&ci->offsets_lock);
+	ci->start_block = 0;
+	ci->starts = NULL;
+	ci->alloc_hint = 0;
+	ci->rsv_start = 0;
+	ci->rsv_len = 0;
+	ci->rsv_keep = false;
+	INIT_LIST_HEAD(&ci->defrag_list);
 	inode_init_once(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
@@ -49,6 +64,7 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	ouichefs_index_drop(inode);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
@@ -67,6 +83,10 @@ static int ouichefs_write_inode(struct inode *inode,
 	if (ino >= sbi->nr_inodes)
 		return 0;
 
+	/* Write back the cached index block along with the inode */
+	if (S_ISREG(inode->i_mode) && ouichefs_index_sync(inode))
+		return -EIO;
+
 	bh = sb_bread(sb, inode_block);
 	if (!bh)
 		return -EIO;
@@ -87,14 +107,33 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_blocks = inode->i_blocks;
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
+	disk_inode->start_block = ci->start_block;
+	disk_inode->i_slices = ci->nr_slices;
 
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	/* Only wait for the device for sync(2) and fsync(2) */
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh);
 	brelse(bh);
 
 	return 0;
 }
 
+/*
+ * Drop the pages of the inode and detach the buffers that were attached to it
+ * by mark_buffer_dirty_inode(). The buffers stay dirty in the block device
+ * mapping and are written back as usual. The blocks reserved for the file
+ * and never used are given back.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	ouichefs_defrag_forget(inode);
+	ouichefs_rsv_release(inode);
+	truncate_inode_pages_final(&inode->i_data);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+}
+
 static int sync_sb_info(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
@@ -112,8 +151,12 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_inodes =
+		percpu_counter_sum_positive(&sbi->free_inodes);
+	/* The blocks of reservation windows are free in the bitmap */
+	disk_sb->nr_free_blocks =
+		percpu_counter_sum_positive(&sbi->free_blocks) +
+		atomic_read(&sbi->nr_rsv_blocks);
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -123,58 +166,47 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	return 0;
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
+/*
+ * Write back the bitmap blocks that were changed since the last sync. The
+ * bitmaps live in their pinned buffers, so nothing needs to be read or copied.
+ */
+static int sync_bitmap(struct buffer_head **bhs, unsigned long *dirty,
+		       uint32_t nr, int wait)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
+	uint32_t i;
+	int ret = 0;
 
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
+	for_each_set_bit(i, dirty, nr) {
+		if (!test_and_clear_bit(i, dirty))
+			continue;
 
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
+		mark_buffer_dirty(bhs[i]);
+		if (wait) {
+			sync_dirty_buffer(bhs[i]);
+			if (buffer_write_io_error(bhs[i]))
+				ret = -EIO;
+		}
+	}
 
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+	return ret;
+}
 
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
+static int sync_ifree(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
-	return 0;
+	/* Flush free inodes bitmask */
+	return sync_bitmap(sbi->ifree_bh, sbi->ifree_dirty,
+			   sbi->nr_ifree_blocks, wait);
 }
 
 static int sync_bfree(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
 
 	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
-
-	return 0;
+	return sync_bitmap(sbi->bfree_bh, sbi->bfree_dirty,
+			   sbi->nr_bfree_blocks, wait);
 }
 
 static void ouichefs_put_super(struct super_block *sb)
@@ -182,8 +214,9 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		ouichefs_defrag_free(sb);
+		ouichefs_index_shrinker_unregister(sb);
+		ouichefs_alloc_free(sbi);
 		kfree(sbi);
 	}
 }
@@ -213,10 +246,10 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bfree = percpu_counter_sum_positive(&sbi->free_blocks);
+	stat->f_bavail = stat->f_bfree;
 	stat->f_files = sbi->nr_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->free_inodes);
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
@@ -227,6 +260,7 @@ static struct super_operations ouichefs_super_ops = {
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
 	.write_inode = ouichefs_write_inode,
+	.evict_inode = ouichefs_evict_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
 };
@@ -238,7 +272,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
@@ -276,56 +310,28 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_fs_info = sbi;
 
 	brelse(bh);
+	bh = NULL;
 
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		ret = -ENOMEM;
+	/* Set up the free counts and groups, the bitmaps are read on demand */
+	ret = ouichefs_alloc_init(sb);
+	if (ret)
 		goto free_sbi;
-	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
-		}
-
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
-
-		brelse(bh);
-	}
-
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
-		ret = -ENOMEM;
-		goto free_ifree;
-	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
 
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	/* Drop cached file indexes under memory pressure */
+	ret = ouichefs_index_shrinker_register(sb);
+	if (ret)
+		goto free_alloc;
 
-		brelse(bh);
-	}
+	/* Compact fragmented files in the background */
+	ret = ouichefs_defrag_init(sb);
+	if (ret)
+		goto unregister_shrinker;
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_defrag;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -338,10 +344,12 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 
 iput:
 	iput(root_inode);
-free_bfree:
-	kfree(sbi->bfree_bitmap);
-free_ifree:
-	kfree(sbi->ifree_bitmap);
+free_defrag:
+	ouichefs_defrag_free(sb);
+unregister_shrinker:
+	ouichefs_index_shrinker_unregister(sb);
+free_alloc:
+	ouichefs_alloc_free(sbi);
 free_sbi:
 	kfree(sbi);
 release:
@@ -1,6 +1,7 @@
 #include "utils.h"
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/statvfs.h>
 
 int test_simple_file_write()
 {
@@ -143,6 +144,84 @@ int test_empty_file()
 	return TEST_SUCCESS;
 }
 
+int test_free_info()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	struct free_info before = { .hide_display = 1 };
+	struct free_info after = { .hide_display = 1 };
+	char wbuf[BLOCK_SIZE * 10];
+	size_t nb_extents = 0;
+	struct statvfs st;
+
+	memset(wbuf, 'a', sizeof(wbuf));
+
+	ioctl(fd, OUICHEFS_IOC_FREE_INFO, &before);
+	write(fd, wbuf, sizeof(wbuf));
+	/* Closing the file gives back the rest of its reservation window */
+	close(fd);
+	fd = open(__func__, O_RDONLY);
+	ioctl(fd, OUICHEFS_IOC_FREE_INFO, &after);
+
+	/* The ten data blocks come from the free space */
+	ASSERT_EQ((size_t)(before.nr_free_blocks - after.nr_free_blocks),
+		  (size_t)10);
+
+	fstatvfs(fd, &st);
+	ASSERT_EQ((size_t)after.nr_free_blocks, (size_t)st.f_bfree);
+
+	for (int i = 0; i < OUICHEFS_FREE_HIST_SIZE; i++)
+		nb_extents += after.histogram[i];
+	ASSERT_EQ(nb_extents, (size_t)after.nr_extents);
+
+	return TEST_SUCCESS;
+}
+
+int test_compact()
+{
+	char name[32], wbuf[BLOCK_SIZE], rbuf[BLOCK_SIZE];
+	struct compact_info info = { .hide_display = 1 };
+	int nb_files = 16;
+
+	/* Checkerboard the free space: create files, remove every other one */
+	for (int i = 0; i < nb_files; i++) {
+		snprintf(name, sizeof(name), "%s_%d", __func__, i);
+		int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		write(fd, wbuf, BLOCK_SIZE);
+		close(fd);
+	}
+	for (int i = 0; i < nb_files; i += 2) {
+		snprintf(name, sizeof(name), "%s_%d", __func__, i);
+		unlink(name);
+	}
+
+	int dir = open(".", O_RDONLY | O_DIRECTORY);
+
+	ASSERT_EQ((ssize_t)ioctl(dir, OUICHEFS_IOC_COMPACT, &info),
+		  (ssize_t)0);
+	close(dir);
+
+	if (info.nr_extents_after > info.nr_extents_before ||
+	    info.largest_after < info.largest_before) {
+		pr_test(ANSI_RED "Free space not compacted\n" ANSI_RESET);
+		return TEST_FAIL;
+	}
+
+	/* The files that were moved still hold their data */
+	flush_cache();
+	for (int i = 1; i < nb_files; i += 2) {
+		snprintf(name, sizeof(name), "%s_%d", __func__, i);
+		int fd = open(name, O_RDONLY);
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		read(fd, rbuf, BLOCK_SIZE);
+		close(fd);
+		ASSERT_EQ_BUF(rbuf, wbuf, BLOCK_SIZE);
+		unlink(name);
+	}
+
+	return TEST_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	int seed = 42;
@@ -160,6 +239,8 @@ int main(int argc, char **argv)
 	RUN_TEST(test_write_filesize_end);
 	RUN_TEST(test_write_block_end);
 	RUN_TEST(test_empty_file);
+	RUN_TEST(test_free_info);
+	RUN_TEST(test_compact);
 
 	return 0;
 }
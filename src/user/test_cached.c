@@ -28,11 +28,10 @@ int test_read_cached()
 	lseek(fd, 0, SEEK_SET);
 	write(fd, wbuf2, len2);
 
-	// not updated because we did not change the write function
-	// so it's not detected as dirty, and still think that it's up-to-date
+	// the insertion drops the cached pages after the cursor
 	lseek(fd, 0, SEEK_SET);
 	read(fd, rbuf, len);
-	ASSERT_EQ_BUF(rbuf, wbuf, len);
+	ASSERT_EQ_BUF(rbuf, wbuf2, len);
 
 	// after cache flush, this should be updated
 	flush_cache();
@@ -43,6 +42,46 @@ int test_read_cached()
 	return TEST_SUCCESS;
 }
 
+int test_read_cached_insert()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT, 0644);
+
+	int counter = 0;
+	size_t len = 3 * BLOCK_SIZE;
+	char wbuf[len];
+	char ibuf[] = "inserted in the middle of a block";
+	size_t ilen = strlen(ibuf);
+	size_t ipos = BLOCK_SIZE + 100;
+	char rbuf[len + ilen];
+
+	init_seq_buff(wbuf, len, &counter);
+	write(fd, wbuf, len);
+
+	/* Fill the page cache before inserting */
+	lseek(fd, 0, SEEK_SET);
+	read(fd, rbuf, len);
+	ASSERT_EQ_BUF(rbuf, wbuf, len);
+
+	lseek(fd, ipos, SEEK_SET);
+	write(fd, ibuf, ilen);
+
+	/* Pages now span several partially filled blocks */
+	lseek(fd, 0, SEEK_SET);
+	read(fd, rbuf, len + ilen);
+	ASSERT_EQ_BUF(rbuf, wbuf, ipos);
+	ASSERT_EQ_BUF(rbuf + ipos, ibuf, ilen);
+	ASSERT_EQ_BUF(rbuf + ipos + ilen, wbuf + ipos, len - ipos);
+
+	/* Same result when reading from disk */
+	flush_cache();
+	lseek(fd, BLOCK_SIZE, SEEK_SET);
+	read(fd, rbuf, len + ilen - BLOCK_SIZE);
+	ASSERT_EQ_BUF(rbuf, wbuf + BLOCK_SIZE, 100);
+	ASSERT_EQ_BUF(rbuf + 100, ibuf, ilen);
+
+	return TEST_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	int seed = 42;
@@ -54,6 +93,7 @@ int main(int argc, char **argv)
 	pr_test("Seed used: %d\n", seed);
 
 	RUN_TEST(test_read_cached);
+	RUN_TEST(test_read_cached_insert);
 
 	return 0;
 }
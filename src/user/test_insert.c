@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include "utils.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 
 /*
  * Automated tests
@@ -50,7 +53,8 @@ int test_write_insert_begin()
 	write(fd, prev_write, prev_len);
 	lseek(fd, 0, SEEK_SET);
 	write(fd, wbuf, len);
-	ASSERT_FILE(fd, 2, (BLOCK_SIZE - prev_len) + (BLOCK_SIZE - len));
+	/* The insert fits in the unused bytes of the block */
+	ASSERT_FILE(fd, 1, BLOCK_SIZE - (prev_len + len));
 
 	char rbuf[prev_len + len];
 
@@ -86,9 +90,7 @@ int test_write_insert()
 
 	lseek(fd, prev_len, SEEK_SET);
 	write(fd, insert_write, insert_len);
-	ASSERT_FILE(fd, 2,
-		    (BLOCK_SIZE - (prev_len + insert_len)) +
-			    (BLOCK_SIZE - next_len));
+	ASSERT_FILE(fd, 1, (BLOCK_SIZE - (prev_len + next_len + insert_len)));
 
 	DEFRAG_FILE(fd);
 	ASSERT_FILE(fd, 1, (BLOCK_SIZE - (prev_len + next_len + insert_len)));
@@ -103,34 +105,386 @@ int test_write_insert()
 	return TEST_SUCCESS;
 }
 
-int test_defrag()
+int test_write_coalesce()
 {
-	int fd = open(__func__, O_RDWR | O_CREAT, 0644);
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char block[BLOCK_SIZE], tail[100], wbuf[10], rbuf[BLOCK_SIZE];
+	size_t pos = 4000;
+
+	memset(block, 'a', BLOCK_SIZE);
+	memset(tail, 'b', sizeof(tail));
+	memset(wbuf, 'c', sizeof(wbuf));
+	write(fd, block, BLOCK_SIZE);
+	write(fd, tail, sizeof(tail));
+	ASSERT_FILE(fd, 2, BLOCK_SIZE - sizeof(tail));
+
+	/*
+	 * The insert splits the full block in place, the end of the block
+	 * is then merged at the start of the tail of the file.
+	 */
+	lseek(fd, pos, SEEK_SET);
+	write(fd, wbuf, sizeof(wbuf));
+	ASSERT_FILE(fd, 3,
+		    (BLOCK_SIZE - pos) + (BLOCK_SIZE - sizeof(wbuf)) +
+			    (BLOCK_SIZE - (BLOCK_SIZE - pos + sizeof(tail))));
 
-	char wbuf[] = "The disco-dancing banana slipped on a rainbow.";
+	lseek(fd, 0, SEEK_SET);
+	read(fd, rbuf, pos);
+	ASSERT_EQ_BUF(rbuf, block, pos);
+	read(fd, rbuf, sizeof(wbuf));
+	ASSERT_EQ_BUF(rbuf, wbuf, sizeof(wbuf));
+	read(fd, rbuf, BLOCK_SIZE - pos);
+	ASSERT_EQ_BUF(rbuf, block, BLOCK_SIZE - pos);
+	read(fd, rbuf, sizeof(tail));
+	ASSERT_EQ_BUF(rbuf, tail, sizeof(tail));
+
+	return TEST_SUCCESS;
+}
+
+/* Check that the next len bytes of a file are all c */
+static int check_bytes(int fd, char c, size_t len)
+{
+	char expected[BLOCK_SIZE], rbuf[BLOCK_SIZE];
+
+	memset(expected, c, len);
+	read(fd, rbuf, len);
+	ASSERT_EQ_BUF(rbuf, expected, len);
+
+	return TEST_SUCCESS;
+}
+
+int test_fallocate_range()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char block[BLOCK_SIZE];
+	size_t cut = 100, half = BLOCK_SIZE / 2;
+
+	for (int i = 0; i < 3; i++) {
+		memset(block, 'a' + i, BLOCK_SIZE);
+		write(fd, block, BLOCK_SIZE);
+	}
+
+	/* Remove the end of the first block and the start of the second */
+	ASSERT_EQ((ssize_t)fallocate(fd, FALLOC_FL_COLLAPSE_RANGE,
+				     BLOCK_SIZE - cut, 2 * cut),
+		  (ssize_t)0);
+	ASSERT_FILE(fd, 3, 2 * cut);
+
+	/* Insert a block of zeros in the middle of the second block */
+	ASSERT_EQ((ssize_t)fallocate(fd, FALLOC_FL_INSERT_RANGE,
+				     BLOCK_SIZE - cut + half, BLOCK_SIZE),
+		  (ssize_t)0);
+	ASSERT_FILE(fd, 4, 2 * cut);
+
+	/* Zero everything after the first half of the second block */
+	ASSERT_EQ((ssize_t)fallocate(fd,
+				     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				     BLOCK_SIZE - cut + half, 3 * BLOCK_SIZE),
+		  (ssize_t)0);
+	ASSERT_FILE(fd, 3, 0);
+	ASSERT_EQ((ssize_t)lseek(fd, 0, SEEK_END),
+		  (ssize_t)(4 * BLOCK_SIZE - 2 * cut));
+
+	lseek(fd, 0, SEEK_SET);
+	if (check_bytes(fd, 'a', BLOCK_SIZE - cut) ||
+	    check_bytes(fd, 'b', half) || check_bytes(fd, 0, BLOCK_SIZE) ||
+	    check_bytes(fd, 0, half - cut) || check_bytes(fd, 0, BLOCK_SIZE))
+		return TEST_FAIL;
+
+	return TEST_SUCCESS;
+}
+
+int test_fallocate_prealloc()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char wbuf[] = "Appended after the preallocated zeros.";
 	size_t len = strlen(wbuf);
-	int iterations = 3;
+	char rbuf[len];
 
-	for (int i = 0; i < iterations; i++) {
-		lseek(fd, 0, SEEK_SET);
+	/* Reserve blocks ahead of the end of the file, its size is kept */
+	ASSERT_EQ((ssize_t)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+				     4 * BLOCK_SIZE),
+		  (ssize_t)0);
+	ASSERT_EQ((ssize_t)lseek(fd, 0, SEEK_END), (ssize_t)0);
+
+	/* Extend the file with zeros, then append to it */
+	ASSERT_EQ((ssize_t)fallocate(fd, 0, 0, 2 * BLOCK_SIZE), (ssize_t)0);
+	ASSERT_FILE(fd, 2, 0);
+	lseek(fd, 0, SEEK_END);
+	write(fd, wbuf, len);
+	ASSERT_FILE(fd, 3, BLOCK_SIZE - len);
+
+	lseek(fd, 0, SEEK_SET);
+	if (check_bytes(fd, 0, BLOCK_SIZE) || check_bytes(fd, 0, BLOCK_SIZE))
+		return TEST_FAIL;
+	read(fd, rbuf, len);
+	ASSERT_EQ_BUF(rbuf, wbuf, len);
+
+	return TEST_SUCCESS;
+}
+
+/*
+ * Write nb_blocks full blocks and insert wbuf in the middle of each of them,
+ * so that every block is split in two halves around a new block.
+ */
+static void write_fragmented(int fd, int nb_blocks, const char *wbuf,
+			     size_t len)
+{
+	char block[BLOCK_SIZE];
+
+	for (int i = 0; i < nb_blocks; i++) {
+		memset(block, 'a' + i, BLOCK_SIZE);
+		write(fd, block, BLOCK_SIZE);
+	}
+	for (int i = 0; i < nb_blocks; i++) {
+		lseek(fd, i * (BLOCK_SIZE + len) + BLOCK_SIZE / 2, SEEK_SET);
 		write(fd, wbuf, len);
 	}
+}
 
-	char rbuf[len];
+/* Check the content of a file written by write_fragmented() */
+static int check_fragmented(int fd, int nb_blocks, const char *wbuf,
+			    size_t len)
+{
+	char half[BLOCK_SIZE / 2], rbuf[BLOCK_SIZE / 2];
 
 	lseek(fd, 0, SEEK_SET);
-	for (int i = 0; i < iterations; i++) {
+	for (int i = 0; i < nb_blocks; i++) {
+		memset(half, 'a' + i, BLOCK_SIZE / 2);
+		read(fd, rbuf, BLOCK_SIZE / 2);
+		ASSERT_EQ_BUF(rbuf, half, BLOCK_SIZE / 2);
 		read(fd, rbuf, len);
 		ASSERT_EQ_BUF(rbuf, wbuf, len);
+		read(fd, rbuf, BLOCK_SIZE / 2);
+		ASSERT_EQ_BUF(rbuf, half, BLOCK_SIZE / 2);
 	}
 
-	ASSERT_FILE(fd, 3, BLOCK_SIZE * 3 - len * 3);
+	return TEST_SUCCESS;
+}
+
+int test_defrag()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char wbuf[] = "The disco-dancing banana slipped on a rainbow.";
+	size_t len = strlen(wbuf);
+	int nb_blocks = 3;
+
+	write_fragmented(fd, nb_blocks, wbuf, len);
+	if (check_fragmented(fd, nb_blocks, wbuf, len))
+		return TEST_FAIL;
+
+	ASSERT_FILE(fd, nb_blocks * 2, (BLOCK_SIZE - len) * nb_blocks);
 	DEFRAG_FILE(fd);
-	ASSERT_FILE(fd, 1, BLOCK_SIZE - len * 3);
+	ASSERT_FILE(fd, nb_blocks + 1, BLOCK_SIZE - len * nb_blocks);
+
+	return check_fragmented(fd, nb_blocks, wbuf, len);
+}
+
+int test_defrag_step()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char wbuf[] = "The disco-dancing banana slipped on a rainbow.";
+	size_t len = strlen(wbuf);
+	int nb_blocks = 4, calls = 0;
+	struct defrag_step step = { .budget_blocks = 2 };
+	unsigned int old_enabled = get_defrag_param("enabled");
+
+	/* Keep the background worker away from the file */
+	set_defrag_param("enabled", 0);
+
+	write_fragmented(fd, nb_blocks, wbuf, len);
+	ASSERT_FILE(fd, nb_blocks * 2, (BLOCK_SIZE - len) * nb_blocks);
+
+	/* Two blocks per call, resuming from the returned cursor */
+	do {
+		ASSERT_EQ((ssize_t)ioctl(fd, OUICHEFS_IOC_DEFRAG_STEP, &step),
+			  (ssize_t)0);
+		ASSERT_EQ((size_t)step.blocks_read, (size_t)2);
+		calls++;
+	} while (!step.done);
+
+	set_defrag_param("enabled", old_enabled);
+
+	ASSERT_EQ((size_t)calls, (size_t)(nb_blocks * 3 - 1));
+	ASSERT_EQ((size_t)step.nb_blocks, (size_t)(nb_blocks + 1));
+	ASSERT_FILE(fd, nb_blocks + 1, BLOCK_SIZE - len * nb_blocks);
+
+	return check_fragmented(fd, nb_blocks, wbuf, len);
+}
+
+int test_defrag_step_shared()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char block[BLOCK_SIZE], wbuf[] = "Written over the inserted zeros.";
+	size_t len = strlen(wbuf), half = BLOCK_SIZE / 2;
+	struct defrag_step step = { 0 };
+	unsigned int old_enabled = get_defrag_param("enabled");
+
+	/* Keep the background worker away from the file */
+	set_defrag_param("enabled", 0);
+
+	for (int i = 0; i < 2; i++) {
+		memset(block, 'a' + i, BLOCK_SIZE);
+		write(fd, block, BLOCK_SIZE);
+	}
+
+	/* Full slices of zeros sharing one block, then a partial one */
+	ASSERT_EQ((ssize_t)fallocate(fd, FALLOC_FL_INSERT_RANGE, BLOCK_SIZE,
+				     2 * BLOCK_SIZE + half),
+		  (ssize_t)0);
+	ASSERT_FILE(fd, 3, 0);
+
+	/* Resume past the shared slices, they must be packed all the same */
+	step.cursor = 5;
+	ASSERT_EQ((ssize_t)ioctl(fd, OUICHEFS_IOC_DEFRAG_STEP, &step),
+		  (ssize_t)0);
+	set_defrag_param("enabled", old_enabled);
+	ASSERT_EQ((size_t)step.done, (size_t)1);
+	ASSERT_FILE(fd, 5, half);
+
+	/* Writing in the first slice of zeros leaves the others untouched */
+	lseek(fd, BLOCK_SIZE, SEEK_SET);
+	write(fd, wbuf, len);
+
+	lseek(fd, 0, SEEK_SET);
+	if (check_bytes(fd, 'a', BLOCK_SIZE))
+		return TEST_FAIL;
+	read(fd, block, len);
+	ASSERT_EQ_BUF(block, wbuf, len);
+	if (check_bytes(fd, 0, BLOCK_SIZE) || check_bytes(fd, 0, BLOCK_SIZE) ||
+	    check_bytes(fd, 0, half) || check_bytes(fd, 'b', BLOCK_SIZE))
+		return TEST_FAIL;
+
+	close(fd);
+	ASSERT_EQ((ssize_t)unlink(__func__), (ssize_t)0);
 
 	return TEST_SUCCESS;
 }
 
+int test_defrag_relocate()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	char wbuf[BLOCK_SIZE], rbuf[BLOCK_SIZE];
+	int nb_blocks = 8, half = nb_blocks / 2;
+
+	for (int i = 0; i < nb_blocks; i++) {
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		write(fd, wbuf, BLOCK_SIZE);
+	}
+
+	/*
+	 * The block after the first half is in use, the inserted block of
+	 * zeros is taken elsewhere and breaks the run.
+	 */
+	ASSERT_EQ((ssize_t)fallocate(fd, FALLOC_FL_INSERT_RANGE,
+				     half * BLOCK_SIZE, BLOCK_SIZE),
+		  (ssize_t)0);
+
+	ASSERT_EQ((ssize_t)ioctl(fd, OUICHEFS_IOC_DEFRAG_RELOCATE),
+		  (ssize_t)1);
+
+	/* The blocks are now contiguous, nothing left to move */
+	ASSERT_EQ((ssize_t)ioctl(fd, OUICHEFS_IOC_DEFRAG_RELOCATE),
+		  (ssize_t)0);
+	ASSERT_FILE(fd, nb_blocks + 1, 0);
+
+	flush_cache();
+	lseek(fd, 0, SEEK_SET);
+	for (int i = 0; i <= nb_blocks; i++) {
+		memset(wbuf, i == half ? 0 : 'a' + i - (i > half), BLOCK_SIZE);
+		read(fd, rbuf, BLOCK_SIZE);
+		ASSERT_EQ_BUF(rbuf, wbuf, BLOCK_SIZE);
+	}
+
+	return TEST_SUCCESS;
+}
+
+int test_defrag_volume()
+{
+	const char *names[] = { "test_defrag_volume_a",
+				"test_defrag_volume_b" };
+	char wbuf[] = "The disco-dancing banana slipped on a rainbow.";
+	size_t len = strlen(wbuf);
+	int fds[2], nb_blocks = 4;
+	struct volume_defrag_info info = { .hide_display = 1 };
+	unsigned int old_enabled = get_defrag_param("enabled");
+
+	/* Keep the background worker away from the files */
+	set_defrag_param("enabled", 0);
+
+	for (int f = 0; f < 2; f++) {
+		fds[f] = open(names[f], O_RDWR | O_CREAT | O_TRUNC, 0644);
+		write_fragmented(fds[f], nb_blocks, wbuf, len);
+		ASSERT_FILE(fds[f], nb_blocks * 2,
+			    (BLOCK_SIZE - len) * nb_blocks);
+	}
+
+	/* The volume is reached through its root directory */
+	int dir = open(".", O_RDONLY | O_DIRECTORY);
+
+	ASSERT_EQ((ssize_t)ioctl(dir, OUICHEFS_IOC_DEFRAG_VOLUME, &info),
+		  (ssize_t)0);
+	close(dir);
+	set_defrag_param("enabled", old_enabled);
+
+	if (info.nr_defragged < 2 || info.wasted_after >= info.wasted_before ||
+	    info.blocks_after >= info.blocks_before) {
+		pr_test(ANSI_RED "Volume not defragmented\n" ANSI_RESET);
+		return TEST_FAIL;
+	}
+
+	for (int f = 0; f < 2; f++) {
+		ASSERT_FILE(fds[f], nb_blocks + 1,
+			    BLOCK_SIZE - len * nb_blocks);
+		if (check_fragmented(fds[f], nb_blocks, wbuf, len))
+			return TEST_FAIL;
+		close(fds[f]);
+	}
+
+	return TEST_SUCCESS;
+}
+
+int test_background_defrag()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	char wbuf[] = "The disco-dancing banana slipped on a rainbow.";
+	size_t len = strlen(wbuf);
+	int nb_blocks = 3;
+	struct file_info info = { .hide_display = 1 };
+	unsigned int old_enabled = get_defrag_param("enabled");
+	unsigned int old_min_waste = get_defrag_param("min_waste");
+	unsigned int old_idle_ms = get_defrag_param("idle_ms");
+
+	set_defrag_param("enabled", 1);
+	set_defrag_param("min_waste", 1);
+	set_defrag_param("idle_ms", 100);
+
+	write_fragmented(fd, nb_blocks, wbuf, len);
+
+	/* Let the worker compact the file once writes stop, 5 s at most */
+	for (int i = 0; i < 100; i++) {
+		ioctl(fd, OUICHEFS_IOC_FILE_INFO, &info);
+		if (info.nb_blocks == nb_blocks + 1)
+			break;
+		usleep(50 * 1000);
+	}
+
+	set_defrag_param("enabled", old_enabled);
+	set_defrag_param("min_waste", old_min_waste);
+	set_defrag_param("idle_ms", old_idle_ms);
+
+	ASSERT_FILE(fd, nb_blocks + 1, BLOCK_SIZE - len * nb_blocks);
+
+	return check_fragmented(fd, nb_blocks, wbuf, len);
+}
+
 int test_write_pos(int fd, int SEEK, int offset)
 {
 	write(fd, "HAHA", 4);
@@ -246,6 +600,74 @@ int test_write_with_offset_end()
 	return ret;
 }
 
+int test_readv()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT, 0644);
+
+	char prev_write[] = "I love to eat chocolate\n";
+	char insert_write[] = "I love banana\n";
+	size_t prev_len = strlen(prev_write);
+	size_t insert_len = strlen(insert_write);
+	size_t split = 7;
+
+	write(fd, prev_write, prev_len);
+	lseek(fd, split, SEEK_SET);
+	write(fd, insert_write, insert_len);
+
+	char rbuf1[split], rbuf2[insert_len], rbuf3[prev_len - split];
+	struct iovec iov[] = {
+		{ .iov_base = rbuf1, .iov_len = sizeof(rbuf1) },
+		{ .iov_base = rbuf2, .iov_len = sizeof(rbuf2) },
+		{ .iov_base = rbuf3, .iov_len = sizeof(rbuf3) },
+	};
+
+	size_t readen = preadv(fd, iov, 3, 0);
+	ASSERT_EQ(readen, prev_len + insert_len);
+	ASSERT_EQ_BUF(rbuf1, prev_write, split);
+	ASSERT_EQ_BUF(rbuf2, insert_write, insert_len);
+	ASSERT_EQ_BUF(rbuf3, prev_write + split, prev_len - split);
+
+	return TEST_SUCCESS;
+}
+
+int test_writev()
+{
+	int fd = open(__func__, O_RDWR | O_CREAT, 0644);
+
+	char prev_write[] = "I love to eat chocolate\n";
+	char buf1[] = "bananas, ";
+	char buf2[] = "apples and ";
+	char buf3[] = "also ";
+	size_t prev_len = strlen(prev_write);
+	size_t len1 = strlen(buf1), len2 = strlen(buf2), len3 = strlen(buf3);
+	size_t insert_len = len1 + len2 + len3;
+	size_t split = 14;
+
+	write(fd, prev_write, prev_len);
+
+	struct iovec iov[] = {
+		{ .iov_base = buf1, .iov_len = len1 },
+		{ .iov_base = buf2, .iov_len = len2 },
+		{ .iov_base = buf3, .iov_len = len3 },
+	};
+
+	size_t written = pwritev(fd, iov, 3, split);
+	ASSERT_EQ(written, insert_len);
+
+	char rbuf[prev_len + insert_len];
+
+	lseek(fd, 0, SEEK_SET);
+	read(fd, rbuf, prev_len + insert_len);
+	ASSERT_EQ_BUF(rbuf, prev_write, split);
+	ASSERT_EQ_BUF(rbuf + split, buf1, len1);
+	ASSERT_EQ_BUF(rbuf + split + len1, buf2, len2);
+	ASSERT_EQ_BUF(rbuf + split + len1 + len2, buf3, len3);
+	ASSERT_EQ_BUF(rbuf + split + insert_len, prev_write + split,
+		      prev_len - split);
+
+	return TEST_SUCCESS;
+}
+
 /*
  * Visual tests
  */
@@ -347,7 +769,15 @@ int main(int argc, char **argv)
 	RUN_TEST(test_hello_world);
 	RUN_TEST(test_write_insert_begin);
 	RUN_TEST(test_write_insert);
+	RUN_TEST(test_write_coalesce);
+	RUN_TEST(test_fallocate_range);
+	RUN_TEST(test_fallocate_prealloc);
 	RUN_TEST(test_defrag);
+	RUN_TEST(test_defrag_step);
+	RUN_TEST(test_defrag_step_shared);
+	RUN_TEST(test_defrag_relocate);
+	RUN_TEST(test_defrag_volume);
+	RUN_TEST(test_background_defrag);
 	RUN_TEST(test_write_end);
 	RUN_TEST(test_write_begin_block);
 	RUN_TEST(test_write_far);
@@ -355,6 +785,8 @@ int main(int argc, char **argv)
 	RUN_TEST(test_write_with_offset);
 	RUN_TEST(test_write_with_offset_far);
 	RUN_TEST(test_write_with_offset_end);
+	RUN_TEST(test_readv);
+	RUN_TEST(test_writev);
 
 	/* visual tests */
 	RUN_TEST(test_big_content);
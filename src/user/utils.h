@@ -69,6 +69,27 @@ static inline char get_write_fn()
 	return write_fn;
 }
 
+/* Change the background defrag policy using sysfs */
+
+static inline void set_defrag_param(const char *name, unsigned int val)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/kernel/ouichefs/defrag/%s", name);
+	int fd = open(path, O_WRONLY);
+	dprintf(fd, "%u", val);
+	close(fd);
+}
+
+static inline unsigned int get_defrag_param(const char *name)
+{
+	char path[64], buf[16] = { 0 };
+	snprintf(path, sizeof(path), "/sys/kernel/ouichefs/defrag/%s", name);
+	int fd = open(path, O_RDONLY);
+	read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	return strtoul(buf, NULL, 10);
+}
+
 /* Test utilities */
 
 #define ANSI_MAGENTA "\x1b[35m"
@@ -5,6 +5,8 @@
 #include "linux/buffer_head.h"
 #include "linux/uaccess.h"
 #include "linux/minmax.h"
+#include "linux/pagemap.h"
+#include "linux/falloc.h"
 #include "ouichefs.h"
 #include "bitmap.h"
 
@@ -33,45 +35,88 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 }
 
 /*
- * Allocate nb_blocks from a block index, update inode blocks number.
+ * Allocate nb_blocks from a block index, update inode blocks number and
+ * slices number, each block being a new slice.
+ * Each range of unallocated entries is filled with contiguous blocks when
+ * possible.
  */
 int reserve_empty_blocks(struct inode *inode,
 			 struct ouichefs_file_index_block *index,
 			 int block_index, int nb_blocks)
 {
-	uint32_t bli, bno;
+	uint32_t bli, bno, nr, len, i;
+	uint32_t end = block_index + nb_blocks;
 
-	for (bli = block_index; bli < block_index + nb_blocks; bli++) {
+	ouichefs_offsets_invalidate(inode, block_index);
+
+	bli = block_index;
+	while (bli < end) {
 		/* Block already allocated */
-		if (index->blocks[bli] != 0)
+		if (index->blocks[bli] != 0) {
+			bli++;
 			continue;
+		}
 
-		/* Allocate a block by removing one from the free list */
-		bno = get_free_block(OUICHEFS_SB(inode->i_sb));
-		if (!bno) {
-			pr_err("get_free_block() failed\n");
+		/* Number of unallocated entries in a row */
+		for (nr = 1; bli + nr < end && index->blocks[bli + nr] == 0;
+		     nr++)
+			;
+
+		/* Allocate a run of blocks, from the file's window first */
+		len = ouichefs_rsv_alloc(inode, nr,
+					 get_alloc_goal(inode, index, bli),
+					 &bno);
+		if (!len) {
+			pr_err("ouichefs_rsv_alloc() failed\n");
 			return 1;
 		}
+		OUICHEFS_INODE(inode)->alloc_hint = bno + len;
 
-		set_block_number(&index->blocks[bli], bno);
-		set_block_size(&index->blocks[bli], 0);
-
-		inode->i_blocks++;
+		for (i = 0; i < len; i++, bli++) {
+			set_block_number(&index->blocks[bli], bno + i);
+			set_block_size(&index->blocks[bli], 0);
+		}
+		inode->i_blocks += len;
+		OUICHEFS_INODE(inode)->nr_slices += len;
 	}
 
 	return 0;
 }
 
 /*
- * Check if we can allocate nb_allocs blocks.
+ * Get the buffer of a block that was just allocated, without reading it from
+ * the device since none of its previous content is kept.
+ */
+struct buffer_head *ouichefs_getblk_new(struct super_block *sb, uint32_t bno)
+{
+	struct buffer_head *bh = sb_getblk(sb, bno);
+
+	if (!bh)
+		return NULL;
+
+	lock_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		memset(bh->b_data, 0, bh->b_size);
+		set_buffer_uptodate(bh);
+	}
+	unlock_buffer(bh);
+
+	return bh;
+}
+
+/*
+ * Check if we can allocate nb_allocs blocks. The blocks reserved for the file
+ * are available to it.
  * Return an error if there is not enough space.
  */
 int space_available(struct inode *inode, struct ouichefs_sb_info *sbi,
 		    int nb_allocs)
 {
-	if (nb_allocs + inode->i_blocks - 1 > OUICHEFS_BLOCK_SIZE >> 2)
+	if (nb_allocs + OUICHEFS_INODE(inode)->nr_slices >
+	    OUICHEFS_BLOCK_SIZE >> 2)
 		return -ENOSPC;
-	if (nb_allocs > sbi->nr_free_blocks)
+	if (nb_allocs > percpu_counter_read_positive(&sbi->free_blocks) +
+				OUICHEFS_INODE(inode)->rsv_len)
 		return -ENOSPC;
 	return 0;
 }
@@ -88,7 +133,7 @@ int reserve_write_blocks(struct inode *inode,
 			 struct ouichefs_file_index_block *index, int nb_allocs)
 {
 	/* We start to allocate after the last block */
-	int alloc_start = max((int)inode->i_blocks - 1, 0);
+	int alloc_start = OUICHEFS_INODE(inode)->nr_slices;
 
 	return reserve_empty_blocks(inode, index, alloc_start, nb_allocs);
 }
@@ -97,12 +142,13 @@ ssize_t ouichefs_write(struct file *file, const char __user *buff, size_t size,
 		       loff_t *pos)
 {
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
+	struct buffer_head *bh_data = NULL;
 	size_t remaining_write = size, written = 0, nb_allocs = 0,
 	       new_file_size = 0;
+	struct kiocb kiocb;
+	ssize_t ret;
 	int nb_blocks, logical_block_index, logical_pos;
 
 	/* Update the pos based on the flags (e.g APPEND) */
@@ -116,22 +162,21 @@ ssize_t ouichefs_write(struct file *file, const char __user *buff, size_t size,
 	/* Check if we can allocate needed blocks */
 	nb_allocs = idiv_ceil(max(*pos + (uint32_t)size, inode->i_size),
 			      OUICHEFS_BLOCK_SIZE);
-	nb_allocs = max((int)nb_allocs - ((int)inode->i_blocks - 1), 0);
+	nb_allocs = max((int)nb_allocs - OUICHEFS_INODE(inode)->nr_slices, 0);
 	if (space_available(inode, sbi, nb_allocs) < 0)
 		return -ENOSPC;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index)
+	/* Get the cached index block */
+	index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index))
 		goto write_end;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/* Allocate needed blocks */
 	if (reserve_write_blocks(inode, index, nb_allocs))
-		goto write_end;
+		goto put_index;
 
-	/* Number of data blocks in the file (without the index block) */
-	nb_blocks = inode->i_blocks - 1;
+	/* Number of data blocks in the file, from its index */
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
 	/* Index of the block where the cursor is */
 	logical_block_index = (*pos) / OUICHEFS_BLOCK_SIZE;
 	/* Cursor position inside the current block */
@@ -146,7 +191,7 @@ ssize_t ouichefs_write(struct file *file, const char __user *buff, size_t size,
 		bno = index->blocks[logical_block_index];
 		bh_data = sb_bread(inode->i_sb, bno);
 		if (!bh_data)
-			goto free_bh_index;
+			goto put_index;
 
 		/* Available size between the cursor and the end of the block */
 		available_size = OUICHEFS_BLOCK_SIZE - logical_pos;
@@ -168,20 +213,18 @@ ssize_t ouichefs_write(struct file *file, const char __user *buff, size_t size,
 		/* The cursor position will start at 0 in subsequent blocks */
 		logical_pos = 0;
 
-		mark_buffer_dirty(bh_data);
-		sync_dirty_buffer(bh_data);
+		mark_buffer_dirty_inode(bh_data, inode);
 		brelse(bh_data);
 	}
 
-	goto free_bh_index;
+	goto put_index;
 
 free_bh_data:
 	brelse(bh_data);
 
-free_bh_index:
-	mark_buffer_dirty(bh_index);
-	sync_dirty_buffer(bh_index);
-	brelse(bh_index);
+put_index:
+	ouichefs_index_mark_dirty(inode);
+	ouichefs_index_put(inode, true);
 
 write_end:
 	written = size - remaining_write;
@@ -194,10 +237,20 @@ write_end:
 	if (written > 0) {
 		inode->i_mtime = inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
+		ouichefs_defrag_note(inode);
 	}
 
 	*pos += written;
 
+	/* Flush the written range for O_SYNC and O_DSYNC files */
+	if (written > 0) {
+		init_sync_kiocb(&kiocb, file);
+		kiocb.ki_pos = *pos;
+		ret = generic_write_sync(&kiocb, written);
+		if (ret < 0)
+			return ret;
+	}
+
 	return written;
 }
 
@@ -208,48 +261,295 @@ write_end:
 /*
  * Shift all blocks from block_index by nb_blocks to the right.
  */
-void shift_blocks(struct ouichefs_file_index_block *index, int block_index,
-		  int nb_shift, int last_bli)
+void shift_blocks(struct inode *inode, struct ouichefs_file_index_block *index,
+		  int block_index, int nb_shift, int last_bli)
 {
 	for (int bli = last_bli; bli >= block_index; bli--) {
 		index->blocks[bli + nb_shift] = index->blocks[bli];
+		set_slice_start(inode, bli + nb_shift,
+				get_slice_start(inode, bli));
+		index->blocks[bli] = 0;
+		set_slice_start(inode, bli, 0);
+	}
+}
+
+/*
+ * Undo shift_blocks(): move the blocks after the nb_shift empty entries from
+ * block_index back to the left.
+ */
+static void unshift_blocks(struct inode *inode,
+			   struct ouichefs_file_index_block *index,
+			   int block_index, int nb_shift, int last_bli)
+{
+	for (int bli = block_index; bli <= last_bli; bli++) {
+		index->blocks[bli] = index->blocks[bli + nb_shift];
+		set_slice_start(inode, bli,
+				get_slice_start(inode, bli + nb_shift));
+		index->blocks[bli + nb_shift] = 0;
+		set_slice_start(inode, bli + nb_shift, 0);
+	}
+}
+
+/*
+ * Free the blocks that reserve_empty_blocks() could allocate in the nb_blocks
+ * entries from block_index, which were all empty before.
+ */
+static void put_new_blocks(struct inode *inode,
+			   struct ouichefs_file_index_block *index,
+			   int block_index, int nb_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	int bli;
+
+	for (bli = block_index; bli < block_index + nb_blocks; bli++) {
+		if (!index->blocks[bli])
+			continue;
+		put_block(sbi, get_block_number(index->blocks[bli]));
+		index->blocks[bli] = 0;
+		inode->i_blocks--;
+		OUICHEFS_INODE(inode)->nr_slices--;
+	}
+}
+
+/*
+ * Remove nb_remove slices from block_index in the index, the following ones
+ * move to the left. Their blocks must be freed by the caller if no other
+ * slice is in them.
+ */
+static void remove_slices(struct inode *inode,
+			  struct ouichefs_file_index_block *index,
+			  int block_index, int nb_remove)
+{
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, bli;
+
+	for (bli = block_index; bli < nb_blocks - nb_remove; bli++) {
+		index->blocks[bli] = index->blocks[bli + nb_remove];
+		set_slice_start(inode, bli,
+				get_slice_start(inode, bli + nb_remove));
+	}
+	for (; bli < nb_blocks; bli++) {
 		index->blocks[bli] = 0;
+		set_slice_start(inode, bli, 0);
 	}
+	OUICHEFS_INODE(inode)->nr_slices -= nb_remove;
 }
 
 /*
- * Copy old content from a block (block_index_from),
- * from logical_pos to its block size,
- * to another block (block_index_to), which is empty.
+ * Split the slice block_index at logical_pos without moving its data: its
+ * end becomes the slice tail_index, in the same block. The file must have a
+ * start block.
  */
-int move_old_content_to(struct ouichefs_file_index_block *index,
-			struct super_block *sb, int block_index_from,
-			int block_index_to, int logical_pos)
+static void split_slice(struct inode *inode,
+			struct ouichefs_file_index_block *index,
+			int block_index, int tail_index, int logical_pos)
 {
-	struct buffer_head *bh_data_from, *bh_data_to;
-	int to_copy =
-		get_block_size(index->blocks[block_index_from]) - logical_pos;
-
-	bh_data_from =
-		sb_bread(sb, get_block_number(index->blocks[block_index_from]));
-	bh_data_to =
-		sb_bread(sb, get_block_number(index->blocks[block_index_to]));
-	if (!bh_data_from || !bh_data_to)
+	int size = get_block_size(index->blocks[block_index]);
+
+	index->blocks[tail_index] = index->blocks[block_index];
+	set_block_size(&index->blocks[tail_index], size - logical_pos);
+	set_slice_start(inode, tail_index,
+			get_slice_start(inode, block_index) + logical_pos);
+	set_block_size(&index->blocks[block_index], logical_pos);
+	OUICHEFS_INODE(inode)->nr_slices++;
+}
+
+/*
+ * Undo split_slice(): give the data of the slice tail_index back to the slice
+ * block_index.
+ */
+static void unsplit_slice(struct inode *inode,
+			  struct ouichefs_file_index_block *index,
+			  int block_index, int tail_index)
+{
+	add_block_size(&index->blocks[block_index],
+		       get_block_size(index->blocks[tail_index]));
+	index->blocks[tail_index] = 0;
+	set_slice_start(inode, tail_index, 0);
+	OUICHEFS_INODE(inode)->nr_slices--;
+}
+
+/*
+ * Insert size bytes at logical_pos in a slice that has enough room after it
+ * for them, by shifting its tail within the block.
+ * Return the number of bytes inserted, or an error.
+ */
+static ssize_t insert_in_slack(struct ouichefs_file_index_block *index,
+			       struct inode *inode, int block_index,
+			       int logical_pos, struct iov_iter *from,
+			       size_t size)
+{
+	struct buffer_head *bh_data;
+	int block_size = get_block_size(index->blocks[block_index]);
+	int tail = block_size - logical_pos;
+	size_t copied;
+	char *data;
+
+	bh_data = sb_bread(inode->i_sb,
+			   get_block_number(index->blocks[block_index]));
+	if (!bh_data)
 		return -EIO;
+	data = bh_data->b_data + get_slice_start(inode, block_index);
+
+	memmove(data + logical_pos + size, data + logical_pos, tail);
+	copied = copy_from_iter(data + logical_pos, size, from);
+	if (copied != size) {
+		/* Close the gap left by the bytes that could not be copied */
+		memmove(data + logical_pos + copied, data + logical_pos + size,
+			tail);
+		memset(data + block_size + copied, 0, size - copied);
+	}
+	set_block_size(&index->blocks[block_index], block_size + copied);
 
-	/*
-	 * Move old content from logical pos in a new empty block.
-	 * Update old and new block size.
-	 */
-	memcpy(bh_data_to->b_data, bh_data_from->b_data + logical_pos, to_copy);
-	memset(bh_data_from->b_data + logical_pos, 0, to_copy);
-	sub_block_size(&index->blocks[block_index_from], to_copy);
-	set_block_size(&index->blocks[block_index_to], to_copy);
+	mark_buffer_dirty_inode(bh_data, inode);
+	brelse(bh_data);
+
+	return copied ? copied : -EFAULT;
+}
+
+/*
+ * Merge the slice that follows block_index with it if both fit in one block,
+ * and free the emptied block. The right slice is appended to the left one if
+ * there is room after it, else the left slice is put in front of the right
+ * one if that one is alone in its block. Only the index and the two blocks
+ * are touched.
+ * Return 1 if the slices were merged, 0 if not, or an error.
+ */
+static int merge_slices(struct ouichefs_file_index_block *index,
+			struct inode *inode, int block_index)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh_left, *bh_right;
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices,
+	    right_index = block_index + 1, removed;
+	uint32_t left, right, size_left, size_right, start_left, start_right,
+		start, bno;
+
+	if (block_index < 0 || right_index >= nb_blocks)
+		return 0;
+	left = index->blocks[block_index];
+	right = index->blocks[right_index];
+	if (!left || !right)
+		return 0;
+	size_left = get_block_size(left);
+	size_right = get_block_size(right);
+	if (size_left + size_right > OUICHEFS_BLOCK_SIZE)
+		return 0;
+	start_left = get_slice_start(inode, block_index);
+	start_right = get_slice_start(inode, right_index);
+
+	/* Two halves of a split slice that are next to each other again */
+	if (get_block_number(left) == get_block_number(right)) {
+		if (start_left + size_left != start_right)
+			return 0;
+		set_block_size(&index->blocks[block_index],
+			       size_left + size_right);
+		removed = right_index;
+		goto remove;
+	}
+
+	if (slice_room(inode, index, block_index) >= size_right)
+		removed = right_index;
+	else if (!slice_shared(inode, index, right_index))
+		removed = block_index;
+	else
+		return 0;
+
+	bh_left = sb_bread(sb, get_block_number(left));
+	bh_right = sb_bread(sb, get_block_number(right));
+	if (!bh_left || !bh_right) {
+		brelse(bh_left);
+		brelse(bh_right);
+		return -EIO;
+	}
+	if (removed == right_index) {
+		memcpy(bh_left->b_data + start_left + size_left,
+		       bh_right->b_data + start_right, size_right);
+		set_block_size(&index->blocks[block_index],
+			       size_left + size_right);
+		mark_buffer_dirty_inode(bh_left, inode);
+	} else {
+		start = start_right >= size_left ? start_right - size_left : 0;
+		memmove(bh_right->b_data + start + size_left,
+			bh_right->b_data + start_right, size_right);
+		memcpy(bh_right->b_data + start,
+		       bh_left->b_data + start_left, size_left);
+		set_block_size(&index->blocks[right_index],
+			       size_left + size_right);
+		set_slice_start(inode, right_index, start);
+		mark_buffer_dirty_inode(bh_right, inode);
+	}
+	brelse(bh_left);
+	brelse(bh_right);
+
+remove:
+	ouichefs_offsets_invalidate(inode, block_index);
+	bno = get_block_number(index->blocks[removed]);
+	if (!slice_shared(inode, index, removed)) {
+		forget_block(sb, bno);
+		inode->i_blocks--;
+	}
+	remove_slices(inode, index, removed, 1);
+
+	return 1;
+}
 
-	mark_buffer_dirty(bh_data_to);
-	sync_dirty_buffer(bh_data_to);
-	brelse(bh_data_from);
-	brelse(bh_data_to);
+/*
+ * Merge the slices written from first to last with their neighbours, so that
+ * inserts do not leave half-empty blocks behind. At most one merge is done
+ * on each side, which bounds the work of a write. Errors are ignored, the
+ * slices are then only left as they are.
+ */
+static void coalesce_slices(struct ouichefs_file_index_block *index,
+			    struct inode *inode, int first, int last)
+{
+	if (!ouichefs_index_sliced(index, OUICHEFS_INODE(inode)->nr_slices))
+		return;
+
+	/* Right side first, it does not move the entries before it */
+	merge_slices(index, inode, last);
+	merge_slices(index, inode, first - 1);
+}
+
+/*
+ * Zero len bytes of the bli-th slice of a file from logical_pos, in place.
+ */
+static int zero_slice(struct inode *inode,
+		      struct ouichefs_file_index_block *index, int bli,
+		      int logical_pos, int len)
+{
+	struct buffer_head *bh_data;
+
+	if (len <= 0)
+		return 0;
+
+	bh_data = sb_bread(inode->i_sb,
+			   get_block_number(index->blocks[bli]));
+	if (!bh_data)
+		return -EIO;
+	memset(bh_data->b_data + get_slice_start(inode, bli) + logical_pos, 0,
+	       len);
+	mark_buffer_dirty_inode(bh_data, inode);
+	brelse(bh_data);
+
+	return 0;
+}
+
+/*
+ * Fill a block with zeros without reading it. Its previous content is lost.
+ */
+static int zero_block(struct inode *inode, uint32_t bno)
+{
+	struct buffer_head *bh = sb_getblk(inode->i_sb, bno);
+
+	if (!bh)
+		return -ENOMEM;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
 
 	return 0;
 }
@@ -265,16 +565,13 @@ int fill_to_reach_pos(struct inode *inode,
 		      int *logical_block_index, int *logical_pos)
 {
 	int bli, last_bli, last_block_size, block_size, nb_blocks_to_fill,
-		to_fill, alloc_start, available_size, remaining;
+		to_fill, alloc_start, available_size, remaining, ret;
 	bool last_block_full = 0;
 	int filled = 0;
 
 	/* Find if there is available size in the last block to avoid allocating */
-	last_bli = max((int)inode->i_blocks - 2, 0);
-	last_block_size = get_block_size(index->blocks[last_bli]);
-	available_size = OUICHEFS_BLOCK_SIZE - last_block_size;
-	if (index->blocks[last_bli] == 0)
-		available_size = 0;
+	last_bli = max(OUICHEFS_INODE(inode)->nr_slices - 1, 0);
+	available_size = slice_room(inode, index, last_bli);
 
 	/* Find how many blocks we need to allocate to fill the gap. */
 	to_fill = pos - inode->i_size;
@@ -284,13 +581,25 @@ int fill_to_reach_pos(struct inode *inode,
 		return -ENOSPC;
 
 	/* Allocate and fill blocks to reach file cursor, start after last block. */
-	alloc_start = max((int)inode->i_blocks - 1, 0);
-	reserve_empty_blocks(inode, index, alloc_start, nb_blocks_to_fill);
+	ouichefs_offsets_invalidate(inode, last_bli);
+	alloc_start = OUICHEFS_INODE(inode)->nr_slices;
+	if (reserve_empty_blocks(inode, index, alloc_start, nb_blocks_to_fill))
+		return -ENOSPC;
+
+	/* The room after the last slice and the new blocks hold old data */
+	ret = zero_slice(inode, index, last_bli,
+			 get_block_size(index->blocks[last_bli]),
+			 min(available_size, to_fill));
+	for (bli = alloc_start; !ret && bli < alloc_start + nb_blocks_to_fill;
+	     bli++)
+		ret = zero_block(inode, get_block_number(index->blocks[bli]));
+	if (ret < 0)
+		return ret;
 
 	bli = (available_size > 0) ? max(alloc_start - 1, 0) : alloc_start;
 	while (filled < to_fill) {
-		remaining = OUICHEFS_BLOCK_SIZE -
-			    get_block_size(index->blocks[bli]);
+		remaining = bli < alloc_start ? available_size :
+						OUICHEFS_BLOCK_SIZE;
 		block_size = min(to_fill - filled, remaining);
 		add_block_size(&index->blocks[bli], block_size);
 		filled += block_size;
@@ -300,166 +609,772 @@ int fill_to_reach_pos(struct inode *inode,
 
 	inode->i_size += filled;
 	last_block_size = get_block_size(index->blocks[bli]);
-	last_block_full = last_block_size == OUICHEFS_BLOCK_SIZE;
+	last_block_full = !slice_room(inode, index, bli);
 	*logical_block_index = last_block_full ? bli + 1 : bli;
 	*logical_pos = last_block_full ? 0 : last_block_size;
 
 	return 0;
 }
 
-ssize_t ouichefs_light_write(struct file *file, const char __user *buff,
-			     size_t size, loff_t *pos)
+/*
+ * Check that an IOCB_NOWAIT write can allocate nb_allocs blocks from bli
+ * without sleeping: they must come from the reservation window of the file,
+ * and a split slice needs the start block to be there already.
+ */
+static int nowait_alloc_check(struct inode *inode,
+			      struct ouichefs_file_index_block *index, int bli,
+			      int nb_allocs, bool split)
 {
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	if (split && !OUICHEFS_INODE(inode)->starts)
+		return -EAGAIN;
+	return ouichefs_rsv_tryreserve(inode, nb_allocs,
+				       get_alloc_goal(inode, index, bli));
+}
+
+/*
+ * Insert the whole iterator at the cursor as a single range: the index is
+ * updated and the blocks are reserved once per call, whatever the number of
+ * segments, so writev() and io_uring pay the insertion cost only once.
+ * The inode is locked and the write was checked by the caller.
+ */
+static ssize_t light_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
-	size_t remaining_write = size, written = 0, nb_allocs = 0, to_copy = 0;
+	struct buffer_head *bh_data = NULL;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	loff_t *pos = &iocb->ki_pos;
+	size_t size = iov_iter_count(from), remaining_write = size, written = 0,
+	       nb_allocs = 0, to_copy = 0;
 	int logical_block_index, logical_pos, alloc_index_start = 0, nb_blocks,
 					      remaining_size, available_size,
-					      last_bli;
-	bool move_old_content = 0, shift_old_content = 0;
+					      last_bli, first_bli = -1,
+					      last_written = -1;
+	bool move_old_content = 0, shift_old_content = 0, split;
 	ssize_t ret = 0;
-
-	/* Update the pos based on the flags (e.g APPEND) */
-	if (write_flags(file, pos) < 0)
-		return -EINVAL;
+	loff_t stale_from;
 
 	/* Check if the write can be completed (enough space?) */
 	if (*pos + size > OUICHEFS_MAX_FILESIZE)
 		return -ENOSPC;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(inode->i_sb, ci->index_block);
-	if (!bh_index) {
-		ret = -EIO;
-		goto write_end;
-	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	/* Everything after the insertion point moves in the file */
+	stale_from = min_t(loff_t, *pos, inode->i_size);
+
+	/* Get the cached index block, without sleeping if asked to */
+	if (nowait)
+		index = ouichefs_index_tryget(inode, true);
+	else
+		index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
 
 	if (*pos > inode->i_size) {
+		/* Filling reads and zeroes blocks, IOCB_NOWAIT cannot wait */
+		if (nowait) {
+			ret = -EAGAIN;
+			goto put_index;
+		}
 		/* We insert after the end of the file, fill to reach the cursor */
 		ret = fill_to_reach_pos(inode, index, sbi, *pos,
 					&logical_block_index, &logical_pos);
 		if (ret < 0)
-			goto free_bh_index;
+			goto put_index;
+		first_bli = last_written = logical_block_index;
 	} else {
 		/* Find logical block index and position in the block based on pos */
-		find_block_pos(*pos, index, inode->i_blocks - 1,
+		find_block_pos(inode, *pos, index,
+			       OUICHEFS_INODE(inode)->nr_slices,
 			       &logical_block_index, &logical_pos);
+		/*
+		 * The end of a slice that cannot grow in place is the start of
+		 * the next one.
+		 */
+		if (index->blocks[logical_block_index] &&
+		    logical_block_index + 1 < OUICHEFS_BLOCK_SIZE >> 2 &&
+		    logical_pos == get_block_size(
+					   index->blocks[logical_block_index]) &&
+		    !slice_room(inode, index, logical_block_index)) {
+			logical_block_index++;
+			logical_pos = 0;
+		}
+		first_bli = last_written = logical_block_index;
 		to_copy = get_block_size(index->blocks[logical_block_index]) -
 			  logical_pos;
-		/* Should we move old content to a new block */
+		/* Should we split the slice we insert into */
 		move_old_content = to_copy > 0;
 		/* Shift only if we are not in the last block */
-		last_bli = max((int)inode->i_blocks - 2, 0);
+		last_bli = max(OUICHEFS_INODE(inode)->nr_slices - 1, 0);
 		shift_old_content = logical_block_index != last_bli;
+
+		/*
+		 * The block we insert into is the only one that is read, the
+		 * others are freshly allocated. Bail out before changing
+		 * anything if it would have to come from the device.
+		 */
+		if (nowait && index->blocks[logical_block_index] != 0 &&
+		    !ouichefs_block_cached(inode->i_sb,
+					   get_block_number(index->blocks
+						   [logical_block_index]))) {
+			ret = -EAGAIN;
+			goto put_index;
+		}
+
+		/*
+		 * Small inserts fit in the unused bytes of the block, shift its
+		 * tail instead of splitting the slice.
+		 */
+		if (move_old_content &&
+		    slice_room(inode, index, logical_block_index) >= size) {
+			ouichefs_offsets_invalidate(inode, logical_block_index);
+			ret = insert_in_slack(index, inode, logical_block_index,
+					      logical_pos, from, size);
+			if (ret > 0)
+				remaining_write -= ret;
+			goto put_index;
+		}
 	}
 
-	/*
-	 * Compute number of blocks needed and check if we can pre-allocate.
-	 * No block is allocated if there is enough space in the block we insert to.
-	 */
-	available_size = OUICHEFS_BLOCK_SIZE - logical_pos;
-	remaining_size = max((int)size - available_size, 0);
-	nb_allocs = idiv_ceil(remaining_size, OUICHEFS_BLOCK_SIZE) +
-		    move_old_content;
-	/* Cursor in new unallocated block */
-	if (index->blocks[logical_block_index] == 0)
-		nb_allocs++;
-	ret = space_available(inode, sbi, nb_allocs);
-	if (ret < 0)
-		goto free_bh_index;
+	if (move_old_content) {
+		/*
+		 * Split the slice at the cursor without copying its data: its
+		 * end stays in the same block, in a new slice after the new
+		 * blocks. Nothing is split when inserting at its start.
+		 */
+		split = logical_pos > 0;
+		nb_allocs = idiv_ceil(size, OUICHEFS_BLOCK_SIZE);
+		ret = space_available(inode, sbi, nb_allocs + split);
+		if (ret < 0)
+			goto put_index;
+		alloc_index_start = logical_block_index + split;
+		if (nowait) {
+			ret = nowait_alloc_check(inode, index, alloc_index_start,
+						 nb_allocs, split);
+			if (ret < 0)
+				goto put_index;
+		}
+		if (split) {
+			ret = ouichefs_starts_alloc(inode);
+			if (ret < 0)
+				goto put_index;
+		}
 
-	/*
-	 * Pre-allocate memory after block that we insert to.
-	 * If the current block was not allocated before, start from it.
-	 */
-	alloc_index_start = logical_block_index + 1;
-	if (index->blocks[logical_block_index] == 0)
-		alloc_index_start--;
-	if (shift_old_content && nb_allocs > 0)
-		shift_blocks(index, alloc_index_start, nb_allocs, last_bli);
-	reserve_empty_blocks(inode, index, alloc_index_start, nb_allocs);
+		ouichefs_offsets_invalidate(inode, logical_block_index);
+		shift_blocks(inode, index, alloc_index_start, nb_allocs + split,
+			     last_bli);
+		if (split)
+			split_slice(inode, index, logical_block_index,
+				    alloc_index_start + nb_allocs, logical_pos);
+		/* The free block count is approximate, the blocks may be gone */
+		if (reserve_empty_blocks(inode, index, alloc_index_start,
+					 nb_allocs)) {
+			put_new_blocks(inode, index, alloc_index_start,
+				       nb_allocs);
+			if (split)
+				unsplit_slice(inode, index, logical_block_index,
+					      alloc_index_start + nb_allocs);
+			unshift_blocks(inode, index, alloc_index_start,
+				       nb_allocs + split, last_bli);
+			ret = -ENOSPC;
+			goto put_index;
+		}
+		last_written = alloc_index_start + nb_allocs - 1 + split;
 
-	/*
-	 * Move old content in logical block index to the last
-	 * pre-allocated block if needed.
-	 */
-	if (move_old_content)
-		ret = move_old_content_to(index, inode->i_sb,
-					  logical_block_index,
-					  logical_block_index + nb_allocs,
-					  logical_pos);
-	if (ret < 0)
-		goto free_bh_index;
+		/* The data goes to the new blocks only */
+		logical_block_index = alloc_index_start;
+		logical_pos = 0;
+	} else {
+		/*
+		 * Compute number of blocks needed and check if we can
+		 * pre-allocate. No block is allocated if there is enough room
+		 * after the slice we write to.
+		 */
+		available_size = OUICHEFS_BLOCK_SIZE;
+		if (index->blocks[logical_block_index])
+			available_size =
+				slice_room(inode, index, logical_block_index);
+		remaining_size = max((int)size - available_size, 0);
+		nb_allocs = idiv_ceil(remaining_size, OUICHEFS_BLOCK_SIZE);
+		/* Cursor in new unallocated block */
+		if (index->blocks[logical_block_index] == 0)
+			nb_allocs++;
+		ret = space_available(inode, sbi, nb_allocs);
+		if (ret < 0)
+			goto put_index;
+
+		/*
+		 * Pre-allocate memory after block that we insert to.
+		 * If the current block was not allocated before, start from it.
+		 */
+		alloc_index_start = logical_block_index + 1;
+		if (index->blocks[logical_block_index] == 0)
+			alloc_index_start--;
+		if (nowait) {
+			ret = nowait_alloc_check(inode, index, alloc_index_start,
+						 nb_allocs, false);
+			if (ret < 0)
+				goto put_index;
+		}
+		ouichefs_offsets_invalidate(inode, logical_block_index);
+		if (shift_old_content && nb_allocs > 0)
+			shift_blocks(inode, index, alloc_index_start, nb_allocs,
+				     last_bli);
+		if (reserve_empty_blocks(inode, index, alloc_index_start,
+					 nb_allocs)) {
+			put_new_blocks(inode, index, alloc_index_start,
+				       nb_allocs);
+			if (shift_old_content && nb_allocs > 0)
+				unshift_blocks(inode, index, alloc_index_start,
+					       nb_allocs, last_bli);
+			ret = -ENOSPC;
+			goto put_index;
+		}
+		last_written = max(last_written,
+				   alloc_index_start + (int)nb_allocs - 1);
+	}
 
-	nb_blocks = inode->i_blocks - 1;
+	nb_blocks = OUICHEFS_INODE(inode)->nr_slices;
 	while (remaining_write && (logical_block_index < nb_blocks)) {
 		uint32_t bno;
-		size_t available_size, len;
+		size_t available_size, len, copied;
 		char *block;
 
-		/* Read data block from disk */
-		bno = index->blocks[logical_block_index];
-		bh_data = sb_bread(inode->i_sb, get_block_number(bno));
+		/* Only the first block holds data, the others are new */
+		bno = get_block_number(index->blocks[logical_block_index]);
+		if (logical_block_index < alloc_index_start)
+			bh_data = sb_bread(inode->i_sb, bno);
+		else
+			bh_data = ouichefs_getblk_new(inode->i_sb, bno);
 		if (!bh_data) {
 			ret = -EIO;
-			goto free_bh_index;
+			goto put_index;
 		}
 
 		/* Available size between the cursor and the end of the block */
-		available_size = OUICHEFS_BLOCK_SIZE - logical_pos;
+		block = (char *)bh_data->b_data +
+			get_slice_start(inode, logical_block_index);
+		available_size = OUICHEFS_BLOCK_SIZE -
+				 get_slice_start(inode, logical_block_index) -
+				 logical_pos;
 		if (available_size == 0) {
 			ret = -ENODATA;
 			goto free_bh_data;
 		}
 		/* Do not write more than what's available and asked */
 		len = min(available_size, remaining_write);
-		block = (char *)bh_data->b_data;
 		/* Copy user data in the block and update its size. */
-		if (copy_from_user(block + logical_pos,
-				   (buff + (size - remaining_write)), len)) {
-			pr_err("copy_from_user() failed\n");
-			ret = -EIO;
+		copied = copy_from_iter(block + logical_pos, len, from);
+		set_block_size(&index->blocks[logical_block_index],
+			       logical_pos + copied);
+		remaining_write -= copied;
+		if (copied != len) {
+			ret = -EFAULT;
+			mark_buffer_dirty_inode(bh_data, inode);
 			goto free_bh_data;
 		}
-		set_block_size(&index->blocks[logical_block_index],
-			       logical_pos + len);
-		remaining_write -= len;
 		logical_block_index += 1;
 		/* The cursor position will start at 0 in subsequent blocks */
 		logical_pos = 0;
 
-		mark_buffer_dirty(bh_data);
-		sync_dirty_buffer(bh_data);
+		mark_buffer_dirty_inode(bh_data, inode);
 		brelse(bh_data);
 	}
 
-	goto free_bh_index;
+	goto put_index;
 
 free_bh_data:
 	brelse(bh_data);
 
-free_bh_index:
-	mark_buffer_dirty(bh_index);
-	sync_dirty_buffer(bh_index);
-	brelse(bh_index);
-
-write_end:
+put_index:
+	/* Merging may have to read blocks, never for IOCB_NOWAIT */
+	if (remaining_write < size && first_bli >= 0 && !nowait)
+		coalesce_slices(index, inode, first_bli, last_written);
+	/* Update file size based on what we could write, with the index */
 	written = size - remaining_write;
-	*pos += written;
+	inode->i_size += written;
+	ouichefs_index_mark_dirty(inode);
+	ouichefs_index_put(inode, true);
 
-	/* Update file size based on what we could write */
+	*pos += written;
 	if (written > 0) {
-		inode->i_size = inode->i_size + written;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
+		ouichefs_defrag_note(inode);
 	}
 
-	if (ret == 0)
+	/*
+	 * Drop the cached pages that no longer hold the right bytes. This is
+	 * done without the index held, as the page cache takes it again when
+	 * reading a locked page.
+	 */
+	if (inode->i_size > stale_from)
+		truncate_inode_pages(inode->i_mapping,
+				     round_down(stale_from, PAGE_SIZE));
+
+	/* Report an error only if nothing could be written */
+	if (written > 0)
 		ret = written;
 
 	return ret;
 }
+
+/*
+ * Write with insertion. Writers of a file are serialized by the inode lock,
+ * which IOCB_NOWAIT requests do not wait for.
+ */
+ssize_t ouichefs_light_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+
+	/* Limits, O_APPEND, then privileges and times, as for other writes */
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	ret = kiocb_modified(iocb);
+	if (ret)
+		goto unlock;
+
+	ret = light_write(iocb, from);
+
+unlock:
+	inode_unlock(inode);
+
+	/* Flush the written range for O_SYNC and O_DSYNC files */
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+
+	return ret;
+}
+
+/*
+ * Range operations of fallocate().
+ */
+
+/*
+ * Return true if a slice outside of [first, last] is in block bno, among the
+ * nr entries listed by ouichefs_sort_slices().
+ */
+static bool block_used_outside(const uint32_t *sorted, int nr, uint32_t bno,
+			       int first, int last)
+{
+	int i, bli;
+
+	for (i = sorted_first(sorted, nr, bno);
+	     i < nr && sorted_bno(sorted[i]) == bno; i++) {
+		bli = sorted_bli(sorted[i]);
+		if (bli < first || bli > last)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Insert len zero bytes at offset. The new slices all point to a single
+ * zeroed block, the slice at offset is split without moving its data.
+ */
+static int insert_range(struct inode *inode,
+			struct ouichefs_file_index_block *index, loff_t offset,
+			loff_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, bli, logical_pos,
+	    nb_zero,
+	    alloc_index_start, i, ret;
+	uint32_t bno;
+	bool split;
+
+	if (find_block_pos(inode, offset, index, nb_blocks, &bli,
+			   &logical_pos))
+		return -EIO;
+	/* Inserting at the end of a slice is inserting before the next one */
+	if (logical_pos && logical_pos == get_block_size(index->blocks[bli])) {
+		bli++;
+		logical_pos = 0;
+	}
+
+	split = logical_pos > 0;
+	nb_zero = DIV_ROUND_UP(len, OUICHEFS_BLOCK_SIZE);
+	if (nb_blocks + nb_zero + split > OUICHEFS_BLOCK_SIZE >> 2)
+		return -ENOSPC;
+	/* Slices sharing a block need their starts */
+	if (split || nb_zero > 1) {
+		ret = ouichefs_starts_alloc(inode);
+		if (ret < 0)
+			return ret;
+	}
+
+	bno = get_free_block(sbi, get_alloc_goal(inode, index, bli));
+	if (!bno)
+		return -ENOSPC;
+	ret = zero_block(inode, bno);
+	if (ret < 0) {
+		put_block(sbi, bno);
+		return ret;
+	}
+
+	alloc_index_start = bli + split;
+	ouichefs_offsets_invalidate(inode, bli);
+	shift_blocks(inode, index, alloc_index_start, nb_zero + split,
+		     nb_blocks - 1);
+	if (split)
+		split_slice(inode, index, bli, alloc_index_start + nb_zero,
+			    logical_pos);
+	for (i = 0; i < nb_zero; i++) {
+		set_block_number(&index->blocks[alloc_index_start + i], bno);
+		set_block_size(&index->blocks[alloc_index_start + i],
+			       min_t(loff_t, len, OUICHEFS_BLOCK_SIZE));
+		len -= OUICHEFS_BLOCK_SIZE;
+	}
+	OUICHEFS_INODE(inode)->nr_slices += nb_zero;
+	inode->i_blocks++;
+
+	return 0;
+}
+
+/*
+ * Remove len bytes at offset. The slices in the range are dropped, the one
+ * at its start is shortened and the one at its end starts further in its
+ * block. Data is only moved when the range is inside a single slice.
+ */
+static int collapse_range(struct inode *inode,
+			  struct ouichefs_file_index_block *index,
+			  loff_t offset, loff_t len)
+{
+	struct buffer_head *bh_data;
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, first, first_pos,
+	    last, last_pos,
+	    last_size, start, ret;
+	char *data;
+
+	if (find_block_pos(inode, offset, index, nb_blocks, &first,
+			   &first_pos) ||
+	    find_block_pos(inode, offset + len, index, nb_blocks, &last,
+			   &last_pos))
+		return -EIO;
+	last_size = get_block_size(index->blocks[last]);
+	ouichefs_offsets_invalidate(inode, first);
+
+	/* Both ends in one slice, close the gap within its block */
+	if (first == last && first_pos > 0 && last_pos < last_size) {
+		bh_data = sb_bread(inode->i_sb,
+				   get_block_number(index->blocks[first]));
+		if (!bh_data)
+			return -EIO;
+		data = bh_data->b_data + get_slice_start(inode, first);
+		memmove(data + first_pos, data + last_pos, last_size - last_pos);
+		memset(data + last_size - len, 0, len);
+		set_block_size(&index->blocks[first], last_size - len);
+		mark_buffer_dirty_inode(bh_data, inode);
+		brelse(bh_data);
+		return 0;
+	}
+
+	/* The end of the range is cut off the last slice */
+	if (last_pos < last_size) {
+		ret = ouichefs_starts_alloc(inode);
+		if (ret < 0)
+			return ret;
+		start = get_slice_start(inode, last) + last_pos;
+		set_block_size(&index->blocks[last], last_size - last_pos);
+		set_slice_start(inode, last, start);
+		last--;
+	}
+	/* The start of the range is cut off the first slice */
+	if (first_pos > 0) {
+		set_block_size(&index->blocks[first], first_pos);
+		first++;
+	}
+
+	if (first <= last) {
+		ouichefs_put_slices(inode, index, first, last, false);
+		remove_slices(inode, index, first, last - first + 1);
+	}
+	/* The slices on both sides of the range are now neighbours */
+	merge_slices(index, inode, first - 1);
+
+	return 0;
+}
+
+/*
+ * Zero len bytes at offset. The slices at both ends of the range are zeroed
+ * in place, the others are pointed to a single zeroed block and their own
+ * blocks are freed.
+ */
+static int punch_range(struct inode *inode,
+		       struct ouichefs_file_index_block *index, loff_t offset,
+		       loff_t len)
+{
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, first, first_pos,
+	    last, last_pos,
+	    last_size, nr_zero = 0, nr = 0, i, ret;
+	uint32_t *sorted = NULL, bno, zero_bno = 0;
+
+	if (find_block_pos(inode, offset, index, nb_blocks, &first,
+			   &first_pos) ||
+	    find_block_pos(inode, offset + len, index, nb_blocks, &last,
+			   &last_pos))
+		return -EIO;
+	last_size = get_block_size(index->blocks[last]);
+
+	if (first == last)
+		return zero_slice(inode, index, first, first_pos,
+				  last_pos - first_pos);
+
+	/* Slices that are only partly in the range */
+	if (first_pos > 0) {
+		ret = zero_slice(inode, index, first, first_pos,
+				 get_block_size(index->blocks[first]) -
+					 first_pos);
+		if (ret < 0)
+			return ret;
+		first++;
+	}
+	if (last_pos < last_size) {
+		ret = zero_slice(inode, index, last, 0, last_pos);
+		if (ret < 0)
+			return ret;
+		last--;
+	}
+
+	/* Only the slices of files with a start block share blocks */
+	if (OUICHEFS_INODE(inode)->starts) {
+		nr = ouichefs_sort_slices(inode, index, &sorted);
+		if (nr < 0)
+			return nr;
+	}
+
+	/*
+	 * Blocks that also hold slices outside the range are zeroed in place.
+	 * The first other block becomes the zero block of the range.
+	 */
+	for (i = first; i <= last; i++) {
+		if (!index->blocks[i])
+			continue;
+		bno = get_block_number(index->blocks[i]);
+		if (block_used_outside(sorted, nr, bno, first, last)) {
+			ret = zero_slice(inode, index, i, 0,
+					 get_block_size(index->blocks[i]));
+			if (ret < 0)
+				goto free_sorted;
+			continue;
+		}
+		if (!zero_bno)
+			zero_bno = bno;
+		nr_zero++;
+	}
+	ret = 0;
+	if (!nr_zero)
+		goto free_sorted;
+
+	/* Slices sharing a block need their starts */
+	if (nr_zero > 1) {
+		ret = ouichefs_starts_alloc(inode);
+		if (ret < 0)
+			goto free_sorted;
+	}
+	ret = zero_block(inode, zero_bno);
+	if (ret < 0)
+		goto free_sorted;
+
+	for (i = first; i <= last; i++) {
+		if (!index->blocks[i])
+			continue;
+		bno = get_block_number(index->blocks[i]);
+		if (block_used_outside(sorted, nr, bno, first, last))
+			continue;
+		set_slice_start(inode, i, 0);
+		if (bno == zero_bno)
+			continue;
+		set_block_number(&index->blocks[i], zero_bno);
+		/* The block is freed along with the last slice in it */
+		if (!sorted ||
+		    sorted_bli(sorted[sorted_first(sorted, nr, bno + 1) - 1]) ==
+			    i) {
+			forget_block(inode->i_sb, bno);
+			inode->i_blocks--;
+		}
+	}
+
+free_sorted:
+	kfree(sorted);
+	return ret;
+}
+
+/*
+ * Reserve the blocks needed to write up to end as one run after the last
+ * block of the file. The run is the reservation window of the file, its next
+ * writes use it. With keep_size, the run stays reserved when the file is
+ * closed. Otherwise, the file is also extended with zeros up to end, in the
+ * blocks of the run. An empty file is given slices if light is true, else the
+ * layout of the page cache.
+ */
+static int prealloc_range(struct inode *inode,
+			  struct ouichefs_file_index_block *index, loff_t end,
+			  bool keep_size, bool light)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	int nb_blocks = OUICHEFS_INODE(inode)->nr_slices, nb_allocs, bli,
+	    logical_pos, ret;
+	loff_t to_alloc;
+	bool sliced;
+
+	sliced = ouichefs_index_sliced(index, nb_blocks) ||
+		 (!inode->i_size && light);
+	if (sliced)
+		to_alloc = end - inode->i_size -
+			   slice_room(inode, index, max(nb_blocks - 1, 0));
+	else
+		to_alloc = end - (loff_t)nb_blocks * OUICHEFS_BLOCK_SIZE;
+	nb_allocs = DIV_ROUND_UP(max_t(loff_t, to_alloc, 0),
+				 OUICHEFS_BLOCK_SIZE);
+	if (nb_blocks + nb_allocs > OUICHEFS_BLOCK_SIZE >> 2)
+		return -ENOSPC;
+
+	ret = ouichefs_rsv_reserve(inode, nb_allocs,
+				   get_alloc_goal(inode, index, nb_blocks));
+	if (ret < 0)
+		return ret;
+	/* Keep the blocks for the next writes, even once the file is closed */
+	if (keep_size) {
+		OUICHEFS_INODE(inode)->rsv_keep = true;
+		return 0;
+	}
+
+	if (sliced)
+		return fill_to_reach_pos(inode, index, sbi, end, &bli,
+					 &logical_pos);
+
+	/* Files written through the page cache have one block per page */
+	if (reserve_empty_blocks(inode, index, nb_blocks, nb_allocs))
+		return -ENOSPC;
+	for (bli = nb_blocks; bli < nb_blocks + nb_allocs; bli++) {
+		ret = zero_block(inode, get_block_number(index->blocks[bli]));
+		if (ret < 0)
+			return ret;
+	}
+	/* The page cache reads these blocks from the device, not the buffers */
+	ret = sync_mapping_buffers(inode->i_mapping);
+	if (ret < 0)
+		return ret;
+	inode->i_size = end;
+
+	return 0;
+}
+
+/*
+ * Preallocate blocks for a file, or insert, remove or zero a range of a file
+ * written by the insert-aware write path. Range operations only touch the
+ * index and the slices at both ends of the range, the data in between is
+ * never copied. Files written through the page cache map page N to block N
+ * and cannot have their ranges moved.
+ */
+long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_file_index_block *index;
+	loff_t end = offset + len;
+	bool range_op = mode & (FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_COLLAPSE_RANGE |
+				FALLOC_FL_INSERT_RANGE);
+	/* Empty files get the layout of the write path of the file, once */
+	bool light = READ_ONCE(file->f_op->write_iter) ==
+		     ouichefs_light_write_iter;
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+
+	if (mode & FALLOC_FL_INSERT_RANGE) {
+		ret = -EINVAL;
+		if (offset >= inode->i_size)
+			goto unlock;
+		ret = -EFBIG;
+		if (inode->i_size + len > OUICHEFS_MAX_FILESIZE)
+			goto unlock;
+	} else if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+		/* The range must end before the end of the file */
+		ret = -EINVAL;
+		if (end >= inode->i_size)
+			goto unlock;
+	} else if (mode & FALLOC_FL_PUNCH_HOLE) {
+		/* Nothing to zero after the end of the file */
+		ret = 0;
+		end = min(end, inode->i_size);
+		if (offset >= end)
+			goto unlock;
+		len = end - offset;
+	} else {
+		/* Every byte of the file already has its block */
+		ret = -EFBIG;
+		if (end > OUICHEFS_MAX_FILESIZE)
+			goto unlock;
+		ret = 0;
+		if (end <= inode->i_size)
+			goto unlock;
+	}
+
+	index = ouichefs_index_get(inode, true);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+		goto unlock;
+	}
+	if (range_op &&
+	    !ouichefs_index_sliced(index, OUICHEFS_INODE(inode)->nr_slices)) {
+		ret = -EOPNOTSUPP;
+		ouichefs_index_put(inode, true);
+		goto unlock;
+	}
+
+	if (mode & FALLOC_FL_INSERT_RANGE) {
+		ret = insert_range(inode, index, offset, len);
+		if (!ret)
+			inode->i_size += len;
+	} else if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+		ret = collapse_range(inode, index, offset, len);
+		if (!ret)
+			inode->i_size -= len;
+	} else if (mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = punch_range(inode, index, offset, len);
+	} else {
+		ret = prealloc_range(inode, index, end,
+				     mode & FALLOC_FL_KEEP_SIZE, light);
+	}
+	if (!ret) {
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+		mark_inode_dirty(inode);
+	}
+	ouichefs_index_mark_dirty(inode);
+	ouichefs_index_put(inode, true);
+
+	if (!range_op)
+		goto unlock;
+
+	/*
+	 * Drop the cached pages that no longer hold the right bytes, without
+	 * the index held as for writes.
+	 */
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		truncate_pagecache_range(inode, offset, end - 1);
+	else
+		truncate_inode_pages(inode->i_mapping,
+				     round_down(offset, PAGE_SIZE));
+	if (!ret)
+		ouichefs_defrag_note(inode);
+
+unlock:
+	inode_unlock(inode);
+
+	return ret;
+}